@@ -0,0 +1,58 @@
+#include <eosio/kafka_plugin/abi_cache.hpp>
+#include <eosio/chain/account_object.hpp>
+#include <algorithm>
+
+namespace eosio {
+
+using namespace chain;
+
+abi_cache::abi_cache (const controller& chain, size_t capacity, const fc::microseconds& max_serialization_time)
+    : chain(chain), capacity(std::max<size_t>(capacity, 1)), max_serialization_time(max_serialization_time) {}
+
+abi_serializer_handle abi_cache::resolve (const account_name& account) {
+    const auto* sequence = chain.db().find<account_sequence_object, by_name>(account);
+    if (sequence == nullptr) return abi_serializer_handle();
+    key_type key{account.value, sequence->abi_sequence};
+    auto itr = index.find(key);
+    if (itr != index.end()) {
+        lru.splice(lru.begin(), lru, itr->second);
+        ++hits;
+        return abi_serializer_handle{itr->second->serializer};
+    }
+    ++misses;
+    auto serializer = load(account);
+    lru.push_front(entry{key, serializer});
+    index[key] = lru.begin();
+    while (lru.size() > capacity) {
+        index.erase(lru.back().key);
+        lru.pop_back();
+        ++evictions;
+    }
+    return abi_serializer_handle{serializer};
+}
+
+void abi_cache::snapshot (abi_snapshot& snapshot, const account_name& account) {
+    if (snapshot.contains(account)) return;
+    snapshot.add(account, resolve(account).serializer);
+}
+
+void abi_cache::invalidate (const account_name& account) {
+    for (auto itr = lru.begin(); itr != lru.end(); ) {
+        if (itr->key.account == account.value) {
+            index.erase(itr->key);
+            itr = lru.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+}
+
+std::shared_ptr<const abi_serializer> abi_cache::load (const account_name& account) const {
+    const auto* account_obj = chain.db().find<account_object, by_name>(account);
+    if (account_obj == nullptr) return nullptr;
+    abi_def abi;
+    if (!abi_serializer::to_abi(account_obj->abi, abi)) return nullptr;
+    return std::make_shared<const abi_serializer>(abi, max_serialization_time);
+}
+
+}
@@ -0,0 +1,419 @@
+//replay recorded messages through the serialization and produce path of kafka_plugin, report throughput and the latency of each stage
+//
+//the recording is the content of an envelope format topic, one message after another, e.g.
+//  kafkacat -C -b ${broker} -t eosio.applied.transaction -e -f '%s' > traces.bin
+//without --broker the messages go to the mock cluster of librdkafka (test.mock.num.brokers)
+//--baseline measures the path before the payload pool, a std::string per message copied by librdkafka
+#include <eosio/kafka_plugin/kafka_plugin.hpp>
+#include <eosio/chain/contract_types.hpp>
+#include <boost/program_options.hpp>
+#include <boost/algorithm/string/join.hpp>
+#include <fc/io/raw.hpp>
+#include <fc/io/json.hpp>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <new>
+
+using namespace eosio;
+namespace bpo = boost::program_options;
+
+//every operator new of the process, so the per message numbers include fc, cppkafka and the benchmark itself
+static std::atomic<uint64_t> heap_allocations{0};
+static std::atomic<uint64_t> heap_allocated_bytes{0};
+
+void* operator new (size_t size) {
+    ++heap_allocations;
+    heap_allocated_bytes += size;
+    if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete (void* p) noexcept { std::free(p); }
+void operator delete (void* p, size_t) noexcept { std::free(p); }
+
+namespace {
+
+//decoded up front, the replay only measures what the plugin does per message
+struct recorded_message {
+    kafka_payload_type type;
+    uint32_t block_num = 0;
+    string key;
+    block_state_ptr block_state;
+    transaction_trace_ptr transaction_trace;
+    transaction_metadata_ptr transaction_metadata;
+    signed_block_ptr block;
+};
+
+struct bench_stats {
+    kafka_stage_stats stages;
+    std::atomic<uint64_t> produced{0};
+    std::atomic<uint64_t> acked{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> acked_bytes{0};
+    std::atomic<uint64_t> dropped{0};       //never handed to librdkafka
+    std::atomic<uint64_t> copied_bytes{0};  //payload bytes librdkafka copied, baseline only
+    std::atomic<uint64_t> unsupported{0};   //recorded split block messages, skipped
+};
+
+class bench {
+public:
+    bench (kafka_payload_format format, const string& topic_name, bool baseline)
+        : format(format), topic_name(topic_name), baseline(baseline) {}
+
+    void load_abi (const account_name& account, const abi_def& abi) {
+        abis.add(account, std::make_shared<const abi_serializer>(abi, fc::seconds(10)));
+    }
+
+    void load_recording (const string& path) {
+        std::ifstream file(path, std::ios::binary);
+        EOS_ASSERT(file.good(), chain::plugin_config_exception, "can not open recording ${p}", ("p", path));
+        vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        fc::datastream<const char*> ds(data.data(), data.size());
+        while (ds.remaining() > 0) {
+            kafka_envelope envelope;
+            fc::raw::unpack(ds, envelope);
+            EOS_ASSERT(envelope.version <= kafka_envelope::current_version && envelope.payload_size <= ds.remaining(),
+                       chain::plugin_config_exception, "${p} is not a recording of an envelope format topic", ("p", path));
+            fc::datastream<const char*> payload(ds.pos(), envelope.payload_size);
+            ds.skip(envelope.payload_size);
+            recorded_message message;
+            message.type = kafka_payload_type(envelope.type);
+            message.block_num = envelope.block_num;
+            switch (message.type) {
+                case kafka_payload_type::block_state: {
+                    auto block_state = std::make_shared<chain::block_state>();
+                    fc::raw::unpack(payload, *block_state);
+                    message.key = string(block_state->id);
+                    collect_abis(*block_state->block);
+                    message.block_state = block_state;
+                    break;
+                }
+                case kafka_payload_type::transaction_trace: {
+                    auto trace = std::make_shared<chain::transaction_trace>();
+                    fc::raw::unpack(payload, *trace);
+                    message.key = string(trace->id);
+                    for (const auto& action_trace : trace->action_traces) {
+                        collect_abis(action_trace);
+                    }
+                    message.transaction_trace = trace;
+                    break;
+                }
+                case kafka_payload_type::transaction_metadata: {
+                    transaction_id_type id, signed_id;
+                    packed_transaction packed_trx;
+                    fc::raw::unpack(payload, id);
+                    fc::raw::unpack(payload, signed_id);
+                    fc::raw::unpack(payload, packed_trx);
+                    message.key = string(id);
+                    message.transaction_metadata = std::make_shared<chain::transaction_metadata>(packed_trx);
+                    break;
+                }
+                case kafka_payload_type::signed_block: {
+                    auto block = std::make_shared<signed_block>();
+                    fc::raw::unpack(payload, *block);
+                    message.key = string(block->id());
+                    collect_abis(*block);
+                    message.block = block;
+                    break;
+                }
+                default:
+                    //split block messages are produced from a block, record the unsplit stream instead
+                    ++stats.unsupported;
+                    continue;
+            }
+            recording.emplace_back(std::move(message));
+        }
+    }
+
+    size_t recording_size () const { return recording.size(); }
+
+    void run (cppkafka::Configuration config, uint64_t messages, uint32_t threads) {
+        config.set_delivery_report_callback([this](cppkafka::Producer&, const cppkafka::Message& message) {
+            //the baseline has no pooled payload, so no ack latency either
+            auto payload = static_cast<pooled_buffer*>(message.get_user_data());
+            if (payload != nullptr) {
+                stats.stages.ack.record_since(payload->produced_at);
+            }
+            if (message.get_error()) {
+                ++stats.failed;
+            } else {
+                ++stats.acked;
+                stats.acked_bytes += message.get_payload().get_size();
+            }
+            if (payload != nullptr) {
+                payload_pool.release(payload);
+            }
+        });
+        producer = std::make_unique<cppkafka::Producer>(config);
+        producer->set_payload_policy(baseline ? cppkafka::Producer::PayloadPolicy::COPY_PAYLOAD
+                                              : cppkafka::Producer::PayloadPolicy::PASSTHROUGH_PAYLOAD);
+        std::atomic<bool> polling{true};
+        std::thread poll_thread([&] {
+            while (polling) producer->poll(std::chrono::milliseconds(100));
+        });
+        std::atomic<uint64_t> next{0};
+        uint64_t allocations = heap_allocations;
+        uint64_t allocated_bytes = heap_allocated_bytes;
+        auto begin = std::chrono::steady_clock::now();
+        vector<std::thread> workers;
+        for (uint32_t i = 0; i < threads; i++) {
+            workers.emplace_back([&] {
+                for (uint64_t n = next++; n < messages; n = next++) {
+                    try {
+                        if (baseline) {
+                            produce_baseline(recording[n % recording.size()]);
+                        } else {
+                            produce(recording[n % recording.size()]);
+                        }
+                    } catch (const fc::exception& ex) {
+                        ++stats.dropped;
+                        std::cerr << ex.to_string() << std::endl;
+                    } catch (const std::exception& ex) {
+                        ++stats.dropped;
+                        std::cerr << ex.what() << std::endl;
+                    }
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        producer->flush();
+        auto end = std::chrono::steady_clock::now();
+        allocations = heap_allocations - allocations;
+        allocated_bytes = heap_allocated_bytes - allocated_bytes;
+        polling = false;
+        poll_thread.join();
+        producer.reset();
+        report(std::chrono::duration<double>(end - begin).count(), allocations, allocated_bytes);
+    }
+
+private:
+    //the last setabi of an account in the recording is used for all of its messages
+    void collect_abi (const action& act) {
+        if (act.account != setabi::get_account() || act.name != setabi::get_name()) return;
+        try {
+            setabi set = act.data_as<setabi>();
+            load_abi(set.account, fc::raw::unpack<abi_def>(set.abi));
+        } catch (...) {
+            //a failed transaction may carry a malformed setabi
+        }
+    }
+
+    void collect_abis (const action_trace& trace) {
+        collect_abi(trace.act);
+        for (const auto& inline_trace : trace.inline_traces) {
+            collect_abis(inline_trace);
+        }
+    }
+
+    void collect_abis (const signed_block& block) {
+        for (const auto& receipt : block.transactions) {
+            if (!receipt.trx.contains<packed_transaction>()) continue;
+            for (const auto& act : receipt.trx.get<packed_transaction>().get_transaction().actions) {
+                collect_abi(act);
+            }
+        }
+    }
+
+    void produce (const recorded_message& message) {
+        kafka_envelope envelope;
+        envelope.type = uint8_t(message.type);
+        envelope.block_num = message.block_num;
+        pooled_buffer_ptr payload(nullptr, pooled_buffer_deleter{&payload_pool});
+        switch (message.type) {
+            case kafka_payload_type::block_state: payload = serialize(envelope, *message.block_state); break;
+            case kafka_payload_type::transaction_trace: payload = serialize(envelope, *message.transaction_trace); break;
+            case kafka_payload_type::transaction_metadata: payload = serialize(envelope, *message.transaction_metadata); break;
+            default: payload = serialize(envelope, *message.block); break;
+        }
+        cppkafka::MessageBuilder builder(topic_name);
+        builder.key(cppkafka::Buffer(message.key.data(), message.key.size()))
+               .payload(cppkafka::Buffer(payload->data(), payload->size)).user_data(payload.get());
+        ++stats.produced;
+        //the benchmark waits out a full librdkafka queue like kafka-plugin-enable-backpressure
+        produce_payload(*producer, builder, true, stopping, stats.stages);
+        payload.release();
+    }
+
+    void produce_baseline (const recorded_message& message) {
+        kafka_envelope envelope;
+        envelope.type = uint8_t(message.type);
+        envelope.block_num = message.block_num;
+        string payload;
+        switch (message.type) {
+            case kafka_payload_type::block_state: payload = serialize_string(envelope, *message.block_state); break;
+            case kafka_payload_type::transaction_trace: payload = serialize_string(envelope, *message.transaction_trace); break;
+            case kafka_payload_type::transaction_metadata: payload = serialize_string(envelope, *message.transaction_metadata); break;
+            default: payload = serialize_string(envelope, *message.block); break;
+        }
+        cppkafka::MessageBuilder builder(topic_name);
+        builder.key(cppkafka::Buffer(message.key.data(), message.key.size()))
+               .payload(cppkafka::Buffer(payload.data(), payload.size()));
+        ++stats.produced;
+        produce_payload(*producer, builder, true, stopping, stats.stages);
+        stats.copied_bytes += payload.size();
+    }
+
+    //the serialization before the payload pool, into a string that grows as it goes
+    template <typename VALUE>
+    string serialize_string (kafka_envelope& envelope, const VALUE& value) {
+        uint64_t begin = latency_histogram::now();
+        if (format == kafka_payload_format::json) {
+            fc::variant tvariant;
+            abi_serializer::to_variant(value, tvariant, [this](const account_name& account) {
+                return abis.resolve(account);
+            }, fc::seconds(10));
+            stats.stages.abi_decode.record_since(begin);
+            begin = latency_histogram::now();
+            string payload = fc::json::to_string(tvariant, fc::json::legacy_generator);
+            stats.stages.json.record_since(begin);
+            return payload;
+        }
+        vector<char> packed = fc::raw::pack(value);
+        envelope.payload_size = packed.size();
+        string payload;
+        if (format == kafka_payload_format::envelope) {
+            vector<char> header = fc::raw::pack(envelope);
+            payload.append(header.data(), header.size());
+        }
+        payload.append(packed.data(), packed.size());
+        stats.stages.pack.record_since(begin);
+        return payload;
+    }
+
+    template <typename VALUE>
+    pooled_buffer_ptr serialize (kafka_envelope& envelope, const VALUE& value) {
+        if (format != kafka_payload_format::json) {
+            return serialize_packed(payload_pool, format, envelope, value, stats.stages);
+        }
+        pooled_buffer_ptr payload = serialize_json(payload_pool, payload_size_hint, value, abis, nullptr, stats.stages);
+        payload_size_hint = payload->size;
+        return payload;
+    }
+
+    void report (double seconds, uint64_t allocations, uint64_t allocated_bytes) const {
+        double messages = std::max<uint64_t>(1, stats.produced);
+        std::cout << "messages        : " << stats.produced << " produced, " << stats.acked << " acked, "
+                  << stats.failed << " failed, " << stats.dropped << " dropped in " << seconds << "s" << std::endl;
+        if (stats.unsupported > 0) {
+            std::cout << "skipped         : " << stats.unsupported << " recorded split block messages" << std::endl;
+        }
+        std::cout << "throughput      : " << uint64_t(stats.acked / seconds) << " msgs/s, "
+                  << uint64_t(stats.acked_bytes / seconds) << " bytes/s" << std::endl;
+        std::cout << "abi decode      : " << stats.stages.abi_decode.summary() << std::endl;
+        std::cout << "json            : " << stats.stages.json.summary() << std::endl;
+        std::cout << "pack            : " << stats.stages.pack.summary() << std::endl;
+        std::cout << "enqueue         : " << stats.stages.enqueue.summary() << std::endl;
+        std::cout << "ack             : " << stats.stages.ack.summary() << std::endl;
+        std::cout << "payload pool    : " << payload_pool.allocation_count() << " allocations, " << payload_pool.reuse_count()
+                  << " reuses, " << payload_pool.copied_bytes() << " bytes copied when growing" << std::endl;
+        std::cout << "per message     : " << (stats.copied_bytes + payload_pool.copied_bytes()) / messages
+                  << " payload bytes copied, " << (allocations + payload_pool.allocation_count()) / messages << " allocations, "
+                  << allocated_bytes / messages << " bytes allocated by operator new" << std::endl;
+    }
+
+    const kafka_payload_format format;
+    const string topic_name;
+    const bool baseline;
+    vector<recorded_message> recording;
+    abi_snapshot abis;
+    buffer_pool payload_pool;
+    std::atomic<size_t> payload_size_hint{0};
+    unique_ptr<cppkafka::Producer> producer;
+    std::atomic<bool> stopping{false};      //never set, every message waits for the cluster
+    bench_stats stats;
+};
+
+}
+
+int main (int argc, char** argv) {
+    bpo::options_description options("kafka_plugin_bench");
+    options.add_options()
+        ("help,h", "print this help")
+        ("recording,r", bpo::value<vector<string> >()->composing(), "recorded messages of an envelope format topic, can have more than one")
+        ("abi", bpo::value<vector<string> >()->composing(), "account=abi.json used for the json format, setabi actions in the recording are picked up too")
+        ("format", bpo::value<string>()->default_value("json"), "payload format to produce: json, packed or envelope")
+        ("messages,n", bpo::value<uint64_t>()->default_value(100000), "messages to produce, the recording is replayed in a loop")
+        ("threads,t", bpo::value<uint32_t>()->default_value(2), "threads that serialize and produce, like kafka-plugin-worker-threads")
+        ("broker", bpo::value<vector<string> >()->composing(), "kafka broker addr, a librdkafka mock cluster is used when not given")
+        ("topic", bpo::value<string>()->default_value("eosio.bench"), "the topic to produce to")
+        ("producer-config", bpo::value<vector<string> >()->composing(), "librdkafka property as key=value, can have more than one")
+        ("baseline", bpo::bool_switch()->default_value(false), "serialize into a std::string per message and let librdkafka copy it, the path before the payload pool")
+        ;
+    bpo::variables_map vm;
+    try {
+        bpo::store(bpo::parse_command_line(argc, argv, options), vm);
+        bpo::notify(vm);
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl << options << std::endl;
+        return 1;
+    }
+    if (vm.count("help") || vm.count("recording") == 0) {
+        std::cout << options << std::endl;
+        return vm.count("help") ? 0 : 1;
+    }
+    try {
+        string format_name = vm.at("format").as<string>();
+        kafka_payload_format format = kafka_payload_format::json;
+        if (format_name == "packed") {
+            format = kafka_payload_format::packed;
+        } else if (format_name == "envelope") {
+            format = kafka_payload_format::envelope;
+        } else if (format_name != "json") {
+            std::cerr << "unknown format " << format_name << std::endl;
+            return 1;
+        }
+        bool baseline = vm.at("baseline").as<bool>();
+        bench b(format, vm.at("topic").as<string>(), baseline);
+        if (vm.count("abi")) {
+            for (const auto& item : vm.at("abi").as<vector<string> >()) {
+                auto pos = item.find('=');
+                if (pos == string::npos) {
+                    std::cerr << "invalid --abi " << item << ", expect account=abi.json" << std::endl;
+                    return 1;
+                }
+                b.load_abi(account_name(item.substr(0, pos)), fc::json::from_file(item.substr(pos + 1)).as<abi_def>());
+            }
+        }
+        for (const auto& path : vm.at("recording").as<vector<string> >()) {
+            b.load_recording(path);
+        }
+        if (b.recording_size() == 0) {
+            std::cerr << "no message found in the recording" << std::endl;
+            return 1;
+        }
+        cppkafka::Configuration config = {
+            {"socket.keepalive.enable", true},
+            {"request.required.acks", 1},
+            {"compression.codec", "gzip"},
+        };
+        if (vm.count("broker")) {
+            config.set("metadata.broker.list", boost::join(vm.at("broker").as<vector<string> >(), ","));
+        } else {
+            config.set("test.mock.num.brokers", "3");
+        }
+        if (vm.count("producer-config")) {
+            for (const auto& item : vm.at("producer-config").as<vector<string> >()) {
+                auto pos = item.find('=');
+                if (pos == string::npos) {
+                    std::cerr << "invalid --producer-config " << item << ", expect key=value" << std::endl;
+                    return 1;
+                }
+                config.set(item.substr(0, pos), item.substr(pos + 1));
+            }
+        }
+        std::cout << "replay " << b.recording_size() << " recorded messages as " << format_name
+                  << (baseline ? ", baseline std::string payloads" : ", pooled payloads") << std::endl;
+        b.run(config, vm.at("messages").as<uint64_t>(), std::max<uint32_t>(1, vm.at("threads").as<uint32_t>()));
+    } catch (const fc::exception& ex) {
+        std::cerr << ex.to_detail_string() << std::endl;
+        return 1;
+    } catch (const std::exception& ex) {
+        std::cerr << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#include <eosio/kafka_plugin/buffer_pool.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace eosio {
+
+buffer_pool::buffer_pool (size_t min_size, size_t max_size, size_t max_cached_bytes)
+    : min_size(min_size), max_cached_bytes(max_cached_bytes) {
+    for (size_t capacity = min_size; capacity <= max_size; capacity *= 2) {
+        classes.emplace_back(std::make_unique<size_class_list>());
+    }
+}
+
+buffer_pool::~buffer_pool () {
+    for (auto& list : classes) {
+        for (auto buffer : list->buffers) {
+            std::free(buffer);
+        }
+    }
+}
+
+size_t buffer_pool::class_of (size_t size) const {
+    size_t capacity = min_size;
+    for (size_t i = 0; i < classes.size(); i++, capacity *= 2) {
+        if (size <= capacity) return i;
+    }
+    return oversized;
+}
+
+pooled_buffer* buffer_pool::allocate (size_t capacity, size_t size_class) {
+    void* mem = std::malloc(sizeof(pooled_buffer) + capacity);
+    if (mem == nullptr) throw std::bad_alloc();
+    ++allocations;
+    return new (mem) pooled_buffer{size_class, capacity, 0, nullptr, 0};
+}
+
+pooled_buffer* buffer_pool::acquire (size_t size) {
+    size_t size_class = class_of(size);
+    if (size_class == oversized) {
+        return allocate(size, oversized);
+    }
+    auto& list = *classes[size_class];
+    {
+        std::lock_guard<std::mutex> lock(list.mtx);
+        if (!list.buffers.empty()) {
+            pooled_buffer* buffer = list.buffers.back();
+            list.buffers.pop_back();
+            buffer->size = 0;
+            buffer->owner = nullptr;
+            buffer->produced_at = 0;
+            ++reuses;
+            return buffer;
+        }
+    }
+    return allocate(min_size << size_class, size_class);
+}
+
+void buffer_pool::release (pooled_buffer* buffer) {
+    if (buffer == nullptr) return;
+    if (buffer->size_class != oversized) {
+        auto& list = *classes[buffer->size_class];
+        std::lock_guard<std::mutex> lock(list.mtx);
+        if ((list.buffers.size() + 1) * buffer->capacity <= max_cached_bytes) {
+            list.buffers.push_back(buffer);
+            return;
+        }
+    }
+    std::free(buffer);
+}
+
+pooled_buffer* buffer_pool::grow (pooled_buffer* buffer, size_t size) {
+    if (size <= buffer->capacity) return buffer;
+    pooled_buffer* bigger = acquire(std::max(size, buffer->capacity * 2));
+    std::memcpy(bigger->data(), buffer->data(), buffer->size);
+    bytes_copied += buffer->size;
+    bigger->size = buffer->size;
+    bigger->owner = buffer->owner;
+    release(buffer);
+    return bigger;
+}
+
+size_t pooled_buffer_stream::writesome (const char* buf, size_t len) {
+    pooled_buffer_deleter deleter = buffer.get_deleter();
+    pooled_buffer* current = buffer.release();
+    try {
+        current = deleter.pool->grow(current, current->size + len);
+    } catch (...) {
+        buffer.reset(current);
+        throw;
+    }
+    buffer.reset(current);
+    std::memcpy(current->data() + current->size, buf, len);
+    current->size += len;
+    return len;
+}
+
+size_t pooled_buffer_stream::writesome (const std::shared_ptr<const char>& buf, size_t len, size_t offset) {
+    return writesome(buf.get() + offset, len);
+}
+
+}
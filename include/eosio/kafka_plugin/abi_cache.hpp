@@ -0,0 +1,88 @@
+#pragma once
+#include <map>
+#include <list>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+#include <eosio/chain/controller.hpp>
+#include <eosio/chain/abi_serializer.hpp>
+
+namespace eosio {
+
+using chain::account_name;
+using chain::abi_serializer;
+
+//what abi_serializer::to_variant expects back from a resolver
+struct abi_serializer_handle {
+    std::shared_ptr<const abi_serializer> serializer;
+
+    bool valid () const { return bool(serializer); }
+    const abi_serializer* operator-> () const { return serializer.get(); }
+    const abi_serializer& operator* () const { return *serializer; }
+};
+
+//the serializers a queued object needs, taken on the chain thread when the object was emitted,
+//the workers decode with it and never touch the controller
+class abi_snapshot {
+public:
+    bool contains (const account_name& account) const { return serializers.count(account) > 0; }
+    void add (const account_name& account, std::shared_ptr<const abi_serializer> serializer) {
+        serializers[account] = std::move(serializer);
+    }
+
+    //an account missing from the snapshot has no abi, its action data stays hex
+    abi_serializer_handle resolve (const account_name& account) const {
+        auto itr = serializers.find(account);
+        return itr == serializers.end() ? abi_serializer_handle() : abi_serializer_handle{itr->second};
+    }
+
+private:
+    std::map<account_name, std::shared_ptr<const abi_serializer> > serializers;    //null when the account has no abi
+};
+
+using abi_snapshot_ptr = std::shared_ptr<const abi_snapshot>;
+
+//bounded lru of built abi_serializer, keyed by account and abi_sequence.
+//it reads the chain state, so it is only used on the chain thread, the serializers it hands out are immutable and shared
+class abi_cache {
+public:
+    abi_cache (const chain::controller& chain, size_t capacity, const fc::microseconds& max_serialization_time);
+
+    //the abi active right now, i.e. when the signal being handled was emitted
+    abi_serializer_handle resolve (const account_name& account);
+    //add the account's current abi to the snapshot unless it is there already
+    void snapshot (abi_snapshot& snapshot, const account_name& account);
+    //drop every entry of the account, called when a setabi is seen
+    void invalidate (const account_name& account);
+
+    uint64_t hit_count () const { return hits; }
+    uint64_t miss_count () const { return misses; }
+    uint64_t eviction_count () const { return evictions; }
+
+private:
+    struct key_type {
+        uint64_t account;
+        uint64_t abi_sequence;
+        bool operator== (const key_type& rhs) const { return account == rhs.account && abi_sequence == rhs.abi_sequence; }
+    };
+    struct key_hash {
+        size_t operator() (const key_type& key) const { return std::hash<uint64_t>()(key.account ^ (key.abi_sequence * 0x9e3779b97f4a7c15ULL)); }
+    };
+    struct entry {
+        key_type key;
+        std::shared_ptr<const abi_serializer> serializer;   //null when the account has no abi
+    };
+
+    std::shared_ptr<const abi_serializer> load (const account_name& account) const;
+
+    const chain::controller& chain;
+    const size_t capacity;
+    const fc::microseconds max_serialization_time;
+    std::list<entry> lru;   //most recently used first
+    std::unordered_map<key_type, std::list<entry>::iterator, key_hash> index;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+};
+
+}
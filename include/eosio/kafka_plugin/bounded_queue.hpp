@@ -0,0 +1,131 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <condition_variable>
+
+namespace eosio {
+
+//what to do when a producer pushes into a full queue
+enum class queue_full_policy {
+    block,          //wait until a consumer makes room
+    drop_oldest,    //discard the oldest pending item
+    grow            //keep the item anyway, the queue grows past its capacity up to its hard limit, then blocks
+};
+
+//bounded multi-producer multi-consumer handoff queue
+template <typename T>
+class bounded_queue {
+public:
+    //hard_limit only matters to the grow policy, it is at least the capacity
+    bounded_queue (size_t capacity, queue_full_policy policy, size_t hard_limit = 0)
+        : capacity(capacity), policy(policy), hard_limit(std::max(capacity, hard_limit)) {}
+
+    //called with every item drop-oldest discards, outside the queue lock
+    void set_drop_handler (std::function<void(T&)> handler) {
+        on_drop = std::move(handler);
+    }
+
+    //push an item, return false if the queue has been closed
+    bool push (T&& item) {
+        T evicted;
+        bool has_evicted = false;
+        std::unique_lock<std::mutex> lock(mtx);
+        if (policy == queue_full_policy::block) {
+            not_full.wait(lock, [this] { return closed || items.size() < capacity; });
+        } else if (policy == queue_full_policy::grow) {
+            not_full.wait(lock, [this] { return closed || items.size() < hard_limit; });
+        }
+        if (closed) return false;
+        if (items.size() >= capacity) {
+            //forced items finish work already started, only the oldest plain item can go
+            auto oldest = std::find_if(items.begin(), items.end(), [](const entry& e) { return !e.forced; });
+            if (policy == queue_full_policy::drop_oldest && oldest != items.end()) {
+                evicted = std::move(oldest->item);
+                items.erase(oldest);
+                has_evicted = true;
+                ++dropped;
+            } else if (policy == queue_full_policy::grow) {
+                ++grown;
+            }
+        }
+        items.push_back(entry{std::move(item), false});
+        lock.unlock();
+        not_empty.notify_one();
+        if (has_evicted && on_drop) {
+            on_drop(evicted);
+        }
+        return true;
+    }
+
+    //push an item ignoring the capacity, for work a consumer splits off while handling an item.
+    //drop-oldest never discards it, return false if the queue has been closed
+    bool force_push (T&& item) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (closed) return false;
+            items.push_back(entry{std::move(item), true});
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    //pop an item, block until one is avaliable, return false once closed and drained
+    bool pop (T& item) {
+        return pop(item, [](T&) {});
+    }
+
+    //on_pop runs under the queue lock, so it sees the items in queue order even with several consumers
+    template <typename F>
+    bool pop (T& item, F&& on_pop) {
+        std::unique_lock<std::mutex> lock(mtx);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        item = std::move(items.front().item);
+        items.pop_front();
+        on_pop(item);
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    //wake up every waiter, the pending items can still be poped
+    void close () {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    size_t size () const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return items.size();
+    }
+
+    uint64_t dropped_count () const { return dropped; }
+    uint64_t grown_count () const { return grown; }
+
+private:
+    struct entry {
+        T item;
+        bool forced;
+    };
+
+    const size_t capacity;
+    const queue_full_policy policy;
+    const size_t hard_limit;
+    std::function<void(T&)> on_drop;
+    mutable std::mutex mtx;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<entry> items;
+    bool closed = false;
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> grown{0};
+};
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <fc/io/iostream.hpp>
+
+namespace eosio {
+
+//payload buffer handed to librdkafka without copy, the header lives in front of the data
+//so a single pointer (the message opaque) is enough to find the owner and return the buffer
+struct pooled_buffer {
+    size_t size_class;
+    size_t capacity;
+    size_t size;
+    void*  owner;
+    uint64_t produced_at;   //when it was handed to librdkafka, for the ack latency
+
+    char* data () { return reinterpret_cast<char*>(this + 1); }
+};
+
+//size-class free lists of pooled_buffer, buffers bigger than the largest class go to the heap
+class buffer_pool {
+public:
+    buffer_pool (size_t min_size = 4 * 1024, size_t max_size = 8 * 1024 * 1024, size_t max_cached_bytes = 64 * 1024 * 1024);
+    ~buffer_pool ();
+
+    pooled_buffer* acquire (size_t size);
+    void release (pooled_buffer* buffer);
+    //make room for size bytes, the content is kept but the buffer may be replaced
+    pooled_buffer* grow (pooled_buffer* buffer, size_t size);
+
+    uint64_t allocation_count () const { return allocations; }
+    uint64_t reuse_count () const { return reuses; }
+    uint64_t copied_bytes () const { return bytes_copied; }
+
+private:
+    struct size_class_list {
+        std::mutex mtx;
+        std::vector<pooled_buffer*> buffers;
+    };
+
+    static constexpr size_t oversized = size_t(-1);
+
+    size_t class_of (size_t size) const;
+    pooled_buffer* allocate (size_t capacity, size_t size_class);
+
+    const size_t min_size;
+    const size_t max_cached_bytes;
+    std::vector<std::unique_ptr<size_class_list> > classes;
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> reuses{0};
+    std::atomic<uint64_t> bytes_copied{0};
+};
+
+//releases the buffer back to the pool unless ownership was handed over
+struct pooled_buffer_deleter {
+    buffer_pool* pool;
+    void operator() (pooled_buffer* buffer) const { pool->release(buffer); }
+};
+using pooled_buffer_ptr = std::unique_ptr<pooled_buffer, pooled_buffer_deleter>;
+
+//fc stream writing straight into a pooled buffer, so fc::json can serialize without an intermediate string
+class pooled_buffer_stream : public fc::ostream {
+public:
+    pooled_buffer_stream (buffer_pool& pool, size_t size_hint)
+        : buffer(pool.acquire(size_hint), pooled_buffer_deleter{&pool}) {}
+
+    size_t writesome (const char* buf, size_t len) override;
+    size_t writesome (const std::shared_ptr<const char>& buf, size_t len, size_t offset) override;
+    void close () override {}
+    void flush () override {}
+
+    pooled_buffer_ptr& get_buffer () { return buffer; }
+
+private:
+    pooled_buffer_ptr buffer;
+};
+
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <atomic>
+#include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
+#include <cppkafka/cppkafka.h>
+#include <eosio/chain/transaction_metadata.hpp>
+#include <eosio/kafka_plugin/buffer_pool.hpp>
+#include <eosio/kafka_plugin/abi_cache.hpp>
+#include <eosio/kafka_plugin/latency_histogram.hpp>
+
+namespace eosio {
+
+//how the objects are encoded in the kafka message
+enum class kafka_payload_format {
+    json,       //abi decoded legacy json
+    packed,     //fc::raw of the chain struct
+    envelope    //kafka_envelope followed by fc::raw of the chain struct
+};
+
+enum class kafka_payload_type : uint8_t {
+    block_state = 1,
+    transaction_trace = 2,
+    transaction_metadata = 3,
+    block_header = 4,
+    block_transaction = 5,
+    block_action = 6,
+    signed_block = 7    //irreversible block caught up from the block log
+};
+
+//small versioned header in front of packed payloads, consumers check the version before decoding
+struct kafka_envelope {
+    static constexpr uint8_t current_version = 2;
+
+    uint8_t  version = current_version;
+    uint8_t  type = 0;
+    uint32_t block_num = 0;     //0 when the object does not belong to a known block
+    uint32_t ordinal = 0;       //position inside the block when a block is split, since version 2
+    uint32_t payload_size = 0;  //bytes of packed object following the envelope
+};
+
+//latency of each step a message goes through, shared by all topics
+struct kafka_stage_stats {
+    latency_histogram handoff;      //signal handler on the chain thread, until its job is queued
+    latency_histogram abi_decode;   //abi_serializer::to_variant
+    latency_histogram json;         //fc::json into the payload buffer
+    latency_histogram pack;         //fc::raw into the payload buffer
+    latency_histogram enqueue;      //produce call, including the backpressure wait
+    latency_histogram ack;          //produce call to delivery report
+};
+
+//the steps every message goes through, shared by kafka_plugin and kafka_plugin_bench
+
+//abi decoded legacy json straight into a pooled buffer, json_type adds a "type" field to tell split messages apart
+template <typename VALUE>
+pooled_buffer_ptr serialize_json (buffer_pool& pool, size_t size_hint, const VALUE& value, const abi_snapshot& abis,
+                                  const char* json_type, kafka_stage_stats& stats) {
+    fc::variant tvariant;
+    uint64_t begin = latency_histogram::now();
+    //the abis active when the object was emitted, never the live chain state
+    abi_serializer::to_variant(value, tvariant, [&abis](const account_name& account) {
+        return abis.resolve(account);
+    }, fc::seconds(10));
+    stats.abi_decode.record_since(begin);
+    if (json_type != nullptr) {
+        tvariant = fc::mutable_variant_object(tvariant.get_object())("type", json_type);
+    }
+    begin = latency_histogram::now();
+    pooled_buffer_stream stream(pool, size_hint);
+    fc::json::to_stream(stream, tvariant, fc::json::legacy_generator);
+    stats.json.record_since(begin);
+    return std::move(stream.get_buffer());
+}
+
+//fc::raw of the value, behind the envelope for the envelope format, envelope.payload_size is filled in
+template <typename VALUE>
+pooled_buffer_ptr serialize_packed (buffer_pool& pool, kafka_payload_format format, kafka_envelope& envelope, const VALUE& value,
+                                    kafka_stage_stats& stats) {
+    //the exact size is known up front, pack straight into the buffer without abi lookups
+    uint64_t begin = latency_histogram::now();
+    envelope.payload_size = fc::raw::pack_size(value);
+    size_t size = envelope.payload_size;
+    if (format == kafka_payload_format::envelope) {
+        size += fc::raw::pack_size(envelope);
+    }
+    pooled_buffer_ptr payload(pool.acquire(size), pooled_buffer_deleter{&pool});
+    fc::datastream<char*> ds(payload->data(), size);
+    if (format == kafka_payload_format::envelope) {
+        fc::raw::pack(ds, envelope);
+    }
+    fc::raw::pack(ds, value);
+    payload->size = size;
+    stats.pack.record_since(begin);
+    return payload;
+}
+
+//hand the message to librdkafka, its user data if any is the pooled payload, which belongs to librdkafka once this returns.
+//with backpressure a full librdkafka queue is waited out instead of thrown, until stopping is set
+void produce_payload (cppkafka::Producer& producer, const cppkafka::MessageBuilder& builder, bool backpressure,
+                      const std::atomic<bool>& stopping, kafka_stage_stats& stats);
+
+}
+
+FC_REFLECT(eosio::kafka_envelope, (version)(type)(block_num)(ordinal)(payload_size))
+
+FC_REFLECT(eosio::chain::transaction_metadata,
+    (id)(signed_id)(packed_trx)(signing_keys)(accepted))
@@ -1,9 +1,22 @@
 #pragma once
+#include <map>
 #include <queue>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <functional>
+#include <boost/filesystem.hpp>
 #include <fc/io/json.hpp>
 #include <cppkafka/cppkafka.h>
 #include <appbase/application.hpp>
 #include <eosio/chain_plugin/chain_plugin.hpp>
+#include <eosio/kafka_plugin/bounded_queue.hpp>
+#include <eosio/kafka_plugin/buffer_pool.hpp>
+#include <eosio/kafka_plugin/abi_cache.hpp>
+#include <eosio/kafka_plugin/spill_journal.hpp>
+#include <eosio/kafka_plugin/latency_histogram.hpp>
+#include <eosio/kafka_plugin/kafka_payload.hpp>
 
 namespace eosio {
 
@@ -14,10 +27,93 @@ using std::unique_ptr;
 using namespace chain;
 using namespace appbase;
 
+//how the messages of a stream are spread over the partitions of its topic
+enum class kafka_partitioner {
+    key,        //librdkafka's partitioner on the message key
+    block_num,  //block number modulo the partition count
+    account,    //hash of the producer of a block or the first action's account of a transaction
+    txid        //hash of the transaction id, transaction streams and split blocks only, block headers fall back to the key
+};
+
+//messages of a split block, each one carries enough to reassemble the block in order
+struct kafka_block_header {
+    uint32_t            block_num = 0;
+    block_id_type       block_id;
+    signed_block_header header;
+    uint32_t            transaction_count = 0;
+};
+
+struct kafka_block_transaction {
+    uint32_t            block_num = 0;
+    block_id_type       block_id;
+    uint32_t            ordinal = 0;        //index in the block's transactions
+    uint32_t            action_count = 0;
+    transaction_receipt receipt;
+};
+
+struct kafka_block_action {
+    uint32_t            block_num = 0;
+    block_id_type       block_id;
+    transaction_id_type trx_id;
+    uint32_t            transaction_ordinal = 0;
+    uint32_t            ordinal = 0;        //index in the transaction's actions
+    action              act;
+};
+
+//last irreversible block committed to kafka in exactly-once mode
+struct kafka_checkpoint {
+    uint32_t      block_num = 0;
+    block_id_type block_id;
+};
+
+//a serialized message waiting for its turn to be produced
+struct kafka_message {
+    int32_t partition = RD_KAFKA_PARTITION_UA;
+    string key;
+    pooled_buffer_ptr payload;
+};
+
+using kafka_batch = vector<kafka_message>;
+
+//a data stream target, the counters are updated by the workers and the delivery report callback
+struct kafka_topic {
+    string stream;  //the data stream feeding it, e.g. accepted-block
+    string name;
+    kafka_payload_format format = kafka_payload_format::json;
+    bool split_blocks = false;  //emit a block as header, transaction and action messages
+    cppkafka::Producer* producer = nullptr;
+    bool spill = false;         //keep undeliverable messages in the spill journal
+    kafka_partitioner partitioner = kafka_partitioner::key;
+    std::atomic<int32_t> partition_count{0};        //read from the topic metadata on first use
+    std::atomic<int64_t> partition_count_retry{0};  //when to ask the brokers again, in ms since epoch
+    std::atomic<uint64_t> produced{0};  //handed to librdkafka
+    std::atomic<uint64_t> acked{0};     //delivery report without error
+    std::atomic<uint64_t> failed{0};    //delivery report with error
+    std::atomic<uint64_t> dropped{0};   //never handed to librdkafka
+    std::atomic<uint64_t> spilled{0};   //written to the spill journal
+    std::atomic<uint64_t> replayed{0};  //handed to librdkafka again from the spill journal
+    std::atomic<size_t> payload_size_hint{0};   //size of the last payload, avoid growing the buffer
+
+    //the workers serialize in parallel, the batches are produced in the order their jobs left the queue
+    uint64_t next_sequence = 0;     //stamped under the job queue lock
+    std::mutex reorder_mtx;
+    uint64_t next_produce = 0;
+    std::map<uint64_t, kafka_batch> reorder;    //serialized batches waiting for an earlier one
+
+    //load the reports first, one arriving between the loads then only makes the result smaller, never wraps it
+    uint64_t in_flight () const {
+        uint64_t reported = acked.load() + failed.load();
+        uint64_t sent = produced.load();
+        return sent > reported ? sent - reported : 0;
+    }
+};
+
 class kafka_plugin : public appbase::plugin<kafka_plugin> {
 public:
     APPBASE_PLUGIN_REQUIRES((chain_plugin))
 
+    ~kafka_plugin();
+
     void set_program_options(options_description&, options_description& cfg) override;
     void plugin_initialize(const variables_map& options);
     void plugin_startup();
@@ -26,20 +122,134 @@ public:
 private:
 
     bool enable;
+    //set once plugin_initialize started the threads, stop joins them from plugin_shutdown or the destructor
+    bool threads_started = false;
+    std::atomic<bool> stopping{false};
+    void stop ();
 
     boost::signals2::connection on_accepted_block_connection;
     boost::signals2::connection on_irreversible_block_connection;
     boost::signals2::connection on_applied_transaction_connection;
     boost::signals2::connection on_accepted_transaction_connection;
 
-    unique_ptr<cppkafka::Producer> kafka_producer;
+    //declared before the producer, the delivery reports return the payloads to it
+    unique_ptr<buffer_pool> payload_pool;
+    unique_ptr<spill_journal> journal;
+    //keyed by the stream's config overrides, streams with the same overrides share a producer
+    std::map<string, unique_ptr<cppkafka::Producer> > producers;
+    //keyed by stream, two streams may write to the same kafka topic with their own settings
+    std::map<string, kafka_topic> topics;
+    unique_ptr<abi_cache> abis;
+
+    //drain delivery reports continuously, otherwise librdkafka's queue fills up
+    std::thread poll_thread;
+    std::atomic<bool> polling{false};
+    bool enable_backpressure;
+
+    //replay the spill journal once the brokers are reachable again
+    std::thread replay_thread;
+    std::atomic<bool> replaying{false};
+    std::atomic<bool> brokers_down{false};
+    std::atomic<int64_t> last_ack_ms{0};    //steady clock, when the last delivery report without error arrived
+
+    void poll_loop ();
+    void replay_loop ();
+    void spill_message (kafka_topic& topic, int32_t partition, const cppkafka::Buffer& key, const cppkafka::Buffer& payload);
+    void on_delivery_report (const cppkafka::Message& message);
+    void produce_message (kafka_topic& topic, const cppkafka::MessageBuilder& builder);
+    int32_t partition_count (kafka_topic& topic);
+    void log_stats ();
+
+    kafka_stage_stats stats;
+    //log the stats every stats_interval seconds, 0 only logs them on shutdown
+    uint32_t stats_interval = 0;
+    std::thread stats_thread;
+    std::atomic<bool> stats_running{false};
+    void stats_loop ();
+
+    //signals only push a job holding the shared pointers, the workers do the heavy work
+    struct kafka_job {
+        kafka_topic* topic = nullptr;
+        uint64_t sequence = 0;
+        std::function<void(kafka_batch&)> serialize;    //appends the messages of the job
+    };
+    unique_ptr<bounded_queue<kafka_job> > job_queue;
+    uint32_t worker_thread_num;
+    vector<std::thread> worker_threads;
+
+    //exactly-once mode, irreversible blocks are produced in order on their own thread, one kafka transaction per block
+    using kafka_task = std::function<void()>;
+    unique_ptr<cppkafka::Producer> transactional_producer;
+    unique_ptr<bounded_queue<kafka_task> > transaction_queue;
+    std::thread transaction_thread;
+    std::atomic<bool> transaction_stopping{false};
+    bool transaction_failed = false;
+    kafka_topic* transactional_topic = nullptr;
+    string checkpoint_topic;
+    string checkpoint_key;          //the transactional id
+    cppkafka::Configuration checkpoint_consumer_config;
+    boost::filesystem::path checkpoint_path;
+    kafka_checkpoint checkpoint;    //transaction thread only
+    std::atomic<uint32_t> last_committed_block{0};  //checkpoint.block_num for the stats
+    std::atomic<uint32_t> first_irreversible_block{0};  //the first one pushed in this run, where a run without checkpoint starts
+
+    void worker_loop ();
+    void transaction_loop ();
+    bool init_transactions ();
+    void produce_in_order (kafka_topic& topic, uint64_t sequence, kafka_batch&& batch);
+    void produce_batch (kafka_topic& topic, kafka_batch& batch);
+    void produce_serialized (kafka_topic& topic, kafka_message& message);
+
+    void load_checkpoint ();
+    bool read_kafka_checkpoint ();
+    void produce_checkpoint (kafka_topic& topic, const kafka_checkpoint& next);
+    void save_checkpoint ();
+    void catch_up_irreversible_blocks (kafka_topic& topic, uint32_t last);
+    bool fetch_irreversible_block (kafka_topic& topic, uint32_t block_num, signed_block_ptr& block, abi_snapshot_ptr& snapshot);
+    void push_transactional_block (kafka_topic& topic, const block_state_ptr& block_state);
+    void produce_transactional_block (kafka_topic& topic, const signed_block_ptr& block, const block_state_ptr& block_state,
+                                      const abi_snapshot_ptr& snapshot);
+    void retry_transaction_call (const std::function<rd_kafka_error_t*()>& call);
+
+    //chain thread only, null for the formats that don't decode actions
+    template <typename OBJ>
+    abi_snapshot_ptr snapshot_abis (const kafka_topic& topic, const OBJ& obj);
+    template <typename OBJ>
+    void collect_object_abis (abi_snapshot& snapshot, const OBJ& obj);
+    void collect_object_abis (abi_snapshot& snapshot, const block_state_ptr& block_state);
+    void collect_object_abis (abi_snapshot& snapshot, const signed_block& block);
+
+    //accounts of the top level actions applied in each block, chain thread only
+    bool track_block_accounts = false;
+    bool block_accounts_until_irreversible = false;    //an irreversible json stream still needs them after accepted_block
+    std::map<uint32_t, flat_set<account_name> > block_accounts;
+    void record_block_accounts (const transaction_trace_ptr& transaction_trace);
+    void release_block_accounts (uint32_t block_num);
+
+    template <typename KEY, typename OBJ>
+    void push_data (kafka_topic& topic, const KEY& key, const OBJ& obj);
+
+    void push_block (kafka_topic& topic, const block_state_ptr& block_state);
+    void serialize_split_block (kafka_topic& topic, const signed_block_ptr& block, const abi_snapshot_ptr& snapshot, bool fan_out,
+                                kafka_batch& batch);
+    void serialize_block_transactions (kafka_topic& topic, const signed_block_ptr& block, const abi_snapshot_ptr& snapshot,
+                                       size_t begin, size_t end, kafka_batch& batch);
 
     template <typename KEY, typename OBJ>
-    void produce_data (const string& topic, const KEY& key, const OBJ& obj, int partition = -1);
+    void serialize_data (kafka_topic& topic, const KEY& key, const OBJ& obj, const abi_snapshot_ptr& snapshot, kafka_batch& batch);
+
+    template <typename VALUE>
+    void serialize_value (kafka_topic& topic, const string& key, kafka_envelope envelope, const VALUE& value,
+                          const abi_snapshot_ptr& snapshot, kafka_batch& batch, const char* json_type = nullptr);
+
+    template <typename VALUE>
+    int32_t select_partition (kafka_topic& topic, const string& key, const VALUE& value);
 
 };
 
 }
 
-FC_REFLECT(eosio::chain::transaction_metadata,
-    (id)(signed_id)(packed_trx)(signing_keys)(accepted))
+FC_REFLECT(eosio::kafka_checkpoint, (block_num)(block_id))
+FC_REFLECT(eosio::kafka_block_header, (block_num)(block_id)(header)(transaction_count))
+FC_REFLECT(eosio::kafka_block_transaction, (block_num)(block_id)(ordinal)(action_count)(receipt))
+FC_REFLECT(eosio::kafka_block_action, (block_num)(block_id)(trx_id)(transaction_ordinal)(ordinal)(act))
@@ -0,0 +1,80 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace eosio {
+
+//lock free latency histogram in microseconds, every power of two is split into 8 linear buckets,
+//so a percentile is off by at most 12.5%
+class latency_histogram {
+public:
+    static uint64_t now () {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void record (uint64_t us) {
+        buckets[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    //record the time passed since begin, which came from now()
+    void record_since (uint64_t begin) {
+        uint64_t end = now();
+        record(end > begin ? end - begin : 0);
+    }
+
+    uint64_t count () const { return total.load(std::memory_order_relaxed); }
+    uint64_t sum_us () const { return sum.load(std::memory_order_relaxed); }
+
+    //upper bound of the bucket holding the p-th percentile, p in [0, 1]
+    uint64_t percentile (double p) const {
+        uint64_t n = count();
+        if (n == 0) return 0;
+        uint64_t rank = uint64_t(p * n);
+        if (rank >= n) rank = n - 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < bucket_count; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen > rank) return upper_bound_of(i);
+        }
+        return upper_bound_of(bucket_count - 1);
+    }
+
+    //one line for the logs, e.g. "count 10, avg 12us, p50 11us, p99 30us, p999 30us"
+    std::string summary () const {
+        uint64_t n = count();
+        return "count " + std::to_string(n) + ", avg " + std::to_string(n == 0 ? 0 : sum_us() / n) + "us"
+            + ", p50 " + std::to_string(percentile(0.5)) + "us"
+            + ", p99 " + std::to_string(percentile(0.99)) + "us"
+            + ", p999 " + std::to_string(percentile(0.999)) + "us";
+    }
+
+private:
+    static constexpr size_t sub_buckets = 8;
+    static constexpr size_t sub_bits = 3;
+    static constexpr size_t bucket_count = sub_buckets + (64 - sub_bits) * sub_buckets;
+
+    static size_t bucket_of (uint64_t us) {
+        if (us < sub_buckets) return us;
+        size_t exponent = 63 - __builtin_clzll(us);
+        size_t sub = (us >> (exponent - sub_bits)) & (sub_buckets - 1);
+        return sub_buckets + (exponent - sub_bits) * sub_buckets + sub;
+    }
+
+    static uint64_t upper_bound_of (size_t bucket) {
+        if (bucket < sub_buckets) return bucket;
+        size_t exponent = (bucket - sub_buckets) / sub_buckets + sub_bits;
+        size_t sub = (bucket - sub_buckets) % sub_buckets;
+        uint64_t lower = uint64_t(sub_buckets + sub) << (exponent - sub_bits);
+        return lower + (uint64_t(1) << (exponent - sub_bits)) - 1;
+    }
+
+    std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sum{0};
+};
+
+}
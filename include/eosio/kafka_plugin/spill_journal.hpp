@@ -0,0 +1,71 @@
+#pragma once
+#include <mutex>
+#include <deque>
+#include <memory>
+#include <string>
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+namespace eosio {
+
+//a journal record, the pointers are valid until the record is poped
+struct spill_record {
+    const char* topic = nullptr;
+    uint32_t    topic_size = 0;
+    int32_t     partition = -1;
+    const char* key = nullptr;
+    uint32_t    key_size = 0;
+    const char* payload = nullptr;
+    uint32_t    payload_size = 0;
+};
+
+//append-only journal of messages kafka could not take, kept in memory-mapped segment files
+//each record carries a crc, a torn record at the end of the last segment is discarded on recovery
+class spill_journal {
+public:
+    spill_journal (const boost::filesystem::path& dir, uint64_t segment_size, uint64_t max_size);
+    ~spill_journal ();
+
+    //return false when the journal is full
+    bool append (const std::string& topic, int32_t partition, const char* key, size_t key_size, const char* payload, size_t payload_size);
+    //the oldest record not poped yet, return false when empty
+    bool front (spill_record& record);
+    void pop ();
+    //write the dirty pages of the mapped segments to disk
+    void sync ();
+
+    bool empty () const;
+    uint64_t record_count () const;
+    uint64_t size () const;
+
+private:
+    struct segment {
+        uint64_t sequence = 0;
+        boost::filesystem::path path;
+        boost::interprocess::file_mapping file;
+        boost::interprocess::mapped_region region;
+        uint64_t read_offset = 0;
+        uint64_t write_offset = 0;
+
+        char* data () const { return static_cast<char*>(region.get_address()); }
+        uint64_t capacity () const { return region.get_size(); }
+    };
+
+    std::unique_ptr<segment> open_segment (const boost::filesystem::path& path, uint64_t sequence) const;
+    std::unique_ptr<segment> create_segment (uint64_t sequence, uint64_t capacity) const;
+    bool read_record (const segment& seg, uint64_t offset, spill_record& record, uint64_t& next) const;
+    void store_read_offset (segment& seg) const;
+    void recover ();
+    void remove_front ();
+
+    const boost::filesystem::path dir;
+    const uint64_t segment_size;
+    const uint64_t max_size;
+    mutable std::mutex mtx;
+    std::deque<std::unique_ptr<segment> > segments;  //read from the front, write to the back
+    uint64_t records = 0;
+    uint64_t total_size = 0;
+};
+
+}
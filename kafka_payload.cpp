@@ -0,0 +1,28 @@
+#include <eosio/kafka_plugin/kafka_payload.hpp>
+#include <chrono>
+#include <thread>
+
+namespace eosio {
+
+void produce_payload (cppkafka::Producer& producer, const cppkafka::MessageBuilder& builder, bool backpressure,
+                      const std::atomic<bool>& stopping, kafka_stage_stats& stats) {
+    uint64_t begin = latency_histogram::now();
+    auto payload = static_cast<pooled_buffer*>(builder.user_data());
+    if (payload != nullptr) {
+        payload->produced_at = begin;
+    }
+    while (true) {
+        try {
+            producer.produce(builder);
+            stats.enqueue.record_since(begin);
+            return;
+        } catch (const cppkafka::HandleException& ex) {
+            //once shutting down the caller spills or drops it, the brokers may never come back
+            if (!backpressure || stopping || ex.get_error().get_error() != RD_KAFKA_RESP_ERR__QUEUE_FULL) throw;
+        }
+        //librdkafka's queue is full, wait for the poll thread to drain the delivery reports
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+}
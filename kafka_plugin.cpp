@@ -1,6 +1,12 @@
 #include <eosio/kafka_plugin/kafka_plugin.hpp>
 #include <boost/algorithm/string/join.hpp>
 #include <fc/io/json.hpp>
+#include <fc/io/raw.hpp>
+#include <eosio/chain/contract_types.hpp>
+#include <fc/filesystem.hpp>
+#include <fc/crypto/city.hpp>
+#include <cstdio>
+#include <unistd.h>
 
 namespace eosio {
 
@@ -11,6 +17,242 @@ namespace bpo = boost::program_options;
 
 static auto& _kafka__plugin = app().register_plugin<kafka_plugin>();
 
+//transactions of a split block handed to one worker job
+static const size_t split_chunk_size = 32;
+
+static const int transaction_timeout_ms = 60000;
+
+//serialization fails the same way every time, a block is skipped after this many attempts instead of stalling the stream
+static const uint32_t transaction_serialize_attempts = 3;
+
+//error of the librdkafka transactional api, tells how the transaction can go on
+struct kafka_transaction_exception : public std::runtime_error {
+    kafka_transaction_exception (const string& what, bool fatal, bool retriable, bool requires_abort)
+        : std::runtime_error(what), fatal(fatal), retriable(retriable), requires_abort(requires_abort) {}
+    bool fatal;             //the producer is unusable
+    bool retriable;         //call the same function again, the outcome of the failed call is unknown
+    bool requires_abort;    //abort the transaction and start it over
+};
+
+//errors that go away once the brokers are reachable again, worth keeping the message for
+static bool is_spillable (rd_kafka_resp_err_t error) {
+    switch (error) {
+        case RD_KAFKA_RESP_ERR__QUEUE_FULL:
+        case RD_KAFKA_RESP_ERR__TRANSPORT:
+        case RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN:
+        case RD_KAFKA_RESP_ERR__MSG_TIMED_OUT:
+        case RD_KAFKA_RESP_ERR__TIMED_OUT:
+        case RD_KAFKA_RESP_ERR__PURGE_QUEUE:
+        case RD_KAFKA_RESP_ERR__PURGE_INFLIGHT:
+        case RD_KAFKA_RESP_ERR_REQUEST_TIMED_OUT:
+        case RD_KAFKA_RESP_ERR_LEADER_NOT_AVAILABLE:
+        case RD_KAFKA_RESP_ERR_NOT_LEADER_FOR_PARTITION:
+        case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS:
+        case RD_KAFKA_RESP_ERR_NOT_ENOUGH_REPLICAS_AFTER_APPEND:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void check_transaction_error (rd_kafka_error_t* error) {
+    if (error == nullptr) return;
+    kafka_transaction_exception ex(rd_kafka_error_string(error), rd_kafka_error_is_fatal(error),
+                                   rd_kafka_error_is_retriable(error), rd_kafka_error_txn_requires_abort(error));
+    rd_kafka_error_destroy(error);
+    throw ex;
+}
+
+static kafka_payload_format parse_payload_format (const string& option, const string& name) {
+    if (name == "json") return kafka_payload_format::json;
+    if (name == "packed") return kafka_payload_format::packed;
+    if (name == "envelope") return kafka_payload_format::envelope;
+    wlog ("unknown ${o} ${n}, use json instead", ("o", option)("n", name));
+    return kafka_payload_format::json;
+}
+
+static kafka_partitioner parse_partitioner (const string& option, const string& name) {
+    if (name == "key") return kafka_partitioner::key;
+    if (name == "block-num") return kafka_partitioner::block_num;
+    if (name == "account") return kafka_partitioner::account;
+    if (name == "txid") return kafka_partitioner::txid;
+    wlog ("unknown ${o} ${n}, use key instead", ("o", option)("n", name));
+    return kafka_partitioner::key;
+}
+
+//key=value items of a config option, a later item overrides an earlier one
+static std::map<string, string> parse_config_option (const variables_map& options, const string& option) {
+    std::map<string, string> items;
+    if (options.count(option) == 0) return items;
+    for (const auto& item : options.at(option).as<vector<string> >()) {
+        auto pos = item.find('=');
+        if (pos == string::npos || pos == 0) {
+            wlog ("invalid ${o} ${i}, expect key=value, ignored", ("o", option)("i", item));
+            continue;
+        }
+        items[item.substr(0, pos)] = item.substr(pos + 1);
+    }
+    return items;
+}
+
+template <typename CONFIG>
+static void apply_config_option (CONFIG& config, const string& option, const std::map<string, string>& items) {
+    for (const auto& item : items) {
+        try {
+            config.set(item.first, item.second);
+        } catch (const cppkafka::ConfigException& ex) {
+            wlog ("invalid ${o} ${k}=${v} : ${ex}, ignored", ("o", option)("k", item.first)("v", item.second)("ex", ex.what()));
+        }
+    }
+}
+
+static kafka_payload_type payload_type (const block_state_ptr&) { return kafka_payload_type::block_state; }
+static kafka_payload_type payload_type (const transaction_trace_ptr&) { return kafka_payload_type::transaction_trace; }
+static kafka_payload_type payload_type (const transaction_metadata_ptr&) { return kafka_payload_type::transaction_metadata; }
+
+static uint32_t payload_block_num (const block_state_ptr& block_state) { return block_state->block_num; }
+static uint32_t payload_block_num (const transaction_trace_ptr&) { return 0; }
+static uint32_t payload_block_num (const transaction_metadata_ptr&) { return 0; }
+
+//block number of the block-num partitioner, 0 falls back to the key
+static uint32_t partition_block_num (const block_state& state) { return state.block_num; }
+static uint32_t partition_block_num (const transaction_trace& trace) { return trace.block_num; }
+static uint32_t partition_block_num (const transaction_metadata&) { return 0; }
+static uint32_t partition_block_num (const signed_block& block) { return block.block_num(); }
+static uint32_t partition_block_num (const kafka_block_header& header) { return header.block_num; }
+static uint32_t partition_block_num (const kafka_block_transaction& trx_message) { return trx_message.block_num; }
+static uint32_t partition_block_num (const kafka_block_action& action_message) { return action_message.block_num; }
+
+static account_name first_account (const vector<action>& actions) {
+    return actions.empty() ? account_name() : actions.front().account;
+}
+
+//account of the account partitioner, the empty name falls back to the key
+static account_name partition_account (const block_state& state) { return state.header.producer; }
+static account_name partition_account (const transaction_trace& trace) {
+    return trace.action_traces.empty() ? account_name() : trace.action_traces.front().act.account;
+}
+static account_name partition_account (const transaction_metadata& metadata) {
+    return first_account(metadata.packed_trx.get_transaction().actions);
+}
+static account_name partition_account (const signed_block& block) { return block.producer; }
+static account_name partition_account (const kafka_block_header& header) { return header.header.producer; }
+static account_name partition_account (const kafka_block_transaction& trx_message) {
+    if (!trx_message.receipt.trx.contains<packed_transaction>()) return account_name();
+    return first_account(trx_message.receipt.trx.get<packed_transaction>().get_transaction().actions);
+}
+static account_name partition_account (const kafka_block_action& action_message) { return action_message.act.account; }
+
+//transaction id of the txid partitioner, block and block header messages have none and fall back to the key
+static transaction_id_type partition_txid (const block_state&) { return transaction_id_type(); }
+static transaction_id_type partition_txid (const transaction_trace& trace) { return trace.id; }
+static transaction_id_type partition_txid (const transaction_metadata& metadata) { return metadata.id; }
+static transaction_id_type partition_txid (const signed_block&) { return transaction_id_type(); }
+static transaction_id_type partition_txid (const kafka_block_header&) { return transaction_id_type(); }
+static transaction_id_type partition_txid (const kafka_block_transaction& trx_message) {
+    if (trx_message.receipt.trx.contains<packed_transaction>()) return trx_message.receipt.trx.get<packed_transaction>().id();
+    return trx_message.receipt.trx.get<transaction_id_type>();
+}
+static transaction_id_type partition_txid (const kafka_block_action& action_message) { return action_message.trx_id; }
+
+//the cache is keyed by abi_sequence so it stays correct anyway, dropping early just frees the stale entries
+static void invalidate_abis (abi_cache& abis, const action_trace& trace) {
+    if (trace.act.account == setabi::get_account() && trace.act.name == setabi::get_name()) {
+        try {
+            abis.invalidate(trace.act.data_as<setabi>().account);
+        } catch (...) {
+            //a failed transaction may carry a malformed setabi, nothing was changed then
+        }
+    }
+    for (const auto& inline_trace : trace.inline_traces) {
+        invalidate_abis(abis, inline_trace);
+    }
+}
+
+static void invalidate_abis (abi_cache& abis, const transaction_trace_ptr& transaction_trace) {
+    for (const auto& trace : transaction_trace->action_traces) {
+        invalidate_abis(abis, trace);
+    }
+}
+
+static void invalidate_abis (abi_cache&, const block_state_ptr&) {}
+static void invalidate_abis (abi_cache&, const transaction_metadata_ptr&) {}
+
+//the accounts whose abi decodes the actions of the object
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const vector<action>& actions) {
+    for (const auto& act : actions) {
+        abis.snapshot(snapshot, act.account);
+    }
+}
+
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const transaction& trx) {
+    collect_abis(abis, snapshot, trx.context_free_actions);
+    collect_abis(abis, snapshot, trx.actions);
+}
+
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const signed_block& block) {
+    for (const auto& receipt : block.transactions) {
+        if (receipt.trx.contains<packed_transaction>()) {
+            collect_abis(abis, snapshot, receipt.trx.get<packed_transaction>().get_transaction());
+        }
+    }
+}
+
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const action_trace& trace) {
+    abis.snapshot(snapshot, trace.act.account);
+    for (const auto& inline_trace : trace.inline_traces) {
+        collect_abis(abis, snapshot, inline_trace);
+    }
+}
+
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const block_state_ptr& block_state) {
+    collect_abis(abis, snapshot, *block_state->block);
+}
+
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const transaction_trace_ptr& transaction_trace) {
+    for (const auto& trace : transaction_trace->action_traces) {
+        collect_abis(abis, snapshot, trace);
+    }
+}
+
+static void collect_abis (abi_cache& abis, abi_snapshot& snapshot, const transaction_metadata_ptr& transaction_metadata) {
+    collect_abis(abis, snapshot, transaction_metadata->packed_trx.get_transaction());
+}
+
+//the chain thread still writes validated, in_current_chain and signing_keys after the signal, the workers get a copy
+static block_state_ptr detach (const block_state_ptr& state) { return std::make_shared<block_state>(*state); }
+static transaction_metadata_ptr detach (const transaction_metadata_ptr& metadata) { return std::make_shared<transaction_metadata>(*metadata); }
+static transaction_trace_ptr detach (const transaction_trace_ptr& trace) { return trace; }
+
+static int64_t steady_ms () {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static kafka_envelope make_envelope (kafka_payload_type type, uint32_t block_num, uint32_t ordinal = 0) {
+    kafka_envelope envelope;
+    envelope.type = uint8_t(type);
+    envelope.block_num = block_num;
+    envelope.ordinal = ordinal;
+    return envelope;
+}
+
+//run one unit of work, a failure only drops that unit
+template <typename F>
+static void catch_and_log (kafka_topic& topic, F&& f) {
+    try{
+        f();
+    } catch (const std::exception& ex) {
+        ++topic.dropped;
+        elog ("std Exception in data_plugin when accept block : ${ex}", ("ex", ex.what()));
+    } catch ( fc::exception& ex) {
+        ++topic.dropped;
+        wlog( "fc Exception in data_plugin when accept block : ${ex}", ("ex", ex.to_detail_string()) );
+    } catch (...) {
+        ++topic.dropped;
+        elog ("Unknown Exception in data_plugin when accept block");
+    }
+}
+
 void kafka_plugin::set_program_options(options_description&, options_description& cfg) {
     cfg.add_options()
         ("kafka-plugin-enable", bpo::bool_switch()->default_value(false), "weather enable the kafka_plugin")
@@ -23,6 +265,40 @@ void kafka_plugin::set_program_options(options_description&, options_description
         ("kafka-plugin-applied-transaction-topic-name", bpo::value<string>()->default_value("eosio.applied.transaction"), "the topic name of applied_transaction")
         ("kafka-plugin-enable-accepted-transaction-connection", bpo::bool_switch()->default_value(false), "enable the data stream that from accepted_transaction callback")
         ("kafka-plugin-accepted-transaction-topic-name", bpo::value<string>()->default_value("eosio.accepted.transaction"), "the topic name of accepted_transaction")
+        ("kafka-plugin-accepted-block-format", bpo::value<string>()->default_value("json"), "payload format of accepted_block: json, packed or envelope")
+        ("kafka-plugin-irreversible-block-format", bpo::value<string>()->default_value("json"), "payload format of irreversible_block: json, packed or envelope")
+        ("kafka-plugin-applied-transaction-format", bpo::value<string>()->default_value("json"), "payload format of applied_transaction: json, packed or envelope")
+        ("kafka-plugin-accepted-transaction-format", bpo::value<string>()->default_value("json"), "payload format of accepted_transaction: json, packed or envelope")
+        ("kafka-plugin-accepted-block-split", bpo::bool_switch()->default_value(false), "emit accepted_block as a header message plus one message per transaction and per action")
+        ("kafka-plugin-irreversible-block-split", bpo::bool_switch()->default_value(false), "emit irreversible_block as a header message plus one message per transaction and per action")
+        ("kafka-plugin-worker-threads", bpo::value<uint32_t>()->default_value(2), "number of threads that serialize the data, each topic still gets its messages in chain order")
+        ("kafka-plugin-queue-size", bpo::value<uint32_t>()->default_value(1024), "max number of signals waiting for the worker threads")
+        ("kafka-plugin-queue-full-policy", bpo::value<string>()->default_value("block"), "what to do when the queue is full: block, drop-oldest or grow")
+        ("kafka-plugin-queue-grow-limit", bpo::value<uint32_t>()->default_value(16384), "max number of signals the grow policy keeps, it blocks beyond it")
+        ("kafka-plugin-enable-backpressure", bpo::bool_switch()->default_value(false), "wait and retry when librdkafka's queue is full instead of dropping the message")
+        ("kafka-plugin-abi-cache-size", bpo::value<uint32_t>()->default_value(1024), "max number of contract abis kept decoded for json serialization")
+        ("kafka-plugin-enable-idempotence", bpo::bool_switch()->default_value(false), "enable the idempotent producer, acks from all in-sync replicas and no duplicates on broker failover")
+        ("kafka-plugin-transactional-id", bpo::value<string>()->default_value(""), "if set, produce each irreversible block and its checkpoint in one kafka transaction and resume from the checkpoint topic after restart")
+        ("kafka-plugin-checkpoint-topic-name", bpo::value<string>()->default_value(""), "compacted topic holding the last irreversible block committed per transactional id, default the irreversible_block topic name plus .checkpoint")
+        ("kafka-plugin-checkpoint-file", bpo::value<string>()->default_value("kafka-plugin.checkpoint"), "local copy of the checkpoint, used while the checkpoint topic is still empty, relative to the data dir")
+        ("kafka-plugin-producer-config", bpo::value<vector<string> >()->composing(), "librdkafka property of every producer as key=value, can have more than one")
+        ("kafka-plugin-accepted-block-producer-config", bpo::value<vector<string> >()->composing(), "librdkafka property of the accepted_block producer as key=value, overrides kafka-plugin-producer-config")
+        ("kafka-plugin-accepted-block-topic-config", bpo::value<vector<string> >()->composing(), "librdkafka topic property of accepted_block as key=value, can have more than one")
+        ("kafka-plugin-accepted-block-partitioner", bpo::value<string>()->default_value("key"), "how accepted_block is spread over the partitions: key, block-num, account or txid, txid needs kafka-plugin-accepted-block-split and keeps the headers on the key")
+        ("kafka-plugin-irreversible-block-producer-config", bpo::value<vector<string> >()->composing(), "librdkafka property of the irreversible_block producer as key=value, overrides kafka-plugin-producer-config")
+        ("kafka-plugin-irreversible-block-topic-config", bpo::value<vector<string> >()->composing(), "librdkafka topic property of irreversible_block as key=value, can have more than one")
+        ("kafka-plugin-irreversible-block-partitioner", bpo::value<string>()->default_value("key"), "how irreversible_block is spread over the partitions: key, block-num, account or txid, txid needs kafka-plugin-irreversible-block-split and keeps the headers on the key")
+        ("kafka-plugin-applied-transaction-producer-config", bpo::value<vector<string> >()->composing(), "librdkafka property of the applied_transaction producer as key=value, overrides kafka-plugin-producer-config")
+        ("kafka-plugin-applied-transaction-topic-config", bpo::value<vector<string> >()->composing(), "librdkafka topic property of applied_transaction as key=value, can have more than one")
+        ("kafka-plugin-applied-transaction-partitioner", bpo::value<string>()->default_value("key"), "how applied_transaction is spread over the partitions: key, block-num, account or txid")
+        ("kafka-plugin-accepted-transaction-producer-config", bpo::value<vector<string> >()->composing(), "librdkafka property of the accepted_transaction producer as key=value, overrides kafka-plugin-producer-config")
+        ("kafka-plugin-accepted-transaction-topic-config", bpo::value<vector<string> >()->composing(), "librdkafka topic property of accepted_transaction as key=value, can have more than one")
+        ("kafka-plugin-accepted-transaction-partitioner", bpo::value<string>()->default_value("key"), "how accepted_transaction is spread over the partitions: key, block-num, account or txid")
+        ("kafka-plugin-stats-interval-sec", bpo::value<uint32_t>()->default_value(0), "log the message counters, queue depths and stage latencies every n seconds, 0 only logs them on shutdown")
+        ("kafka-plugin-enable-spill", bpo::bool_switch()->default_value(false), "write the messages kafka can not take to a local journal and replay them once the brokers are back")
+        ("kafka-plugin-spill-dir", bpo::value<string>()->default_value("kafka-spill"), "the directory of the spill journal, relative to the data dir")
+        ("kafka-plugin-spill-segment-size-mb", bpo::value<uint32_t>()->default_value(64), "size of one spill journal segment file")
+        ("kafka-plugin-spill-max-size-mb", bpo::value<uint32_t>()->default_value(4096), "max size of the spill journal, messages are dropped beyond it")
         ;
 }
 
@@ -38,10 +314,32 @@ void kafka_plugin::plugin_initialize(const variables_map& options) {
     string applied_transaction_topic_name = options.at("kafka-plugin-applied-transaction-topic-name").as<string>();
     bool enable_accepted_transaction_connection = options.at("kafka-plugin-enable-accepted-transaction-connection").as<bool>();
     string accepted_transaction_topic_name = options.at("kafka-plugin-accepted-transaction-topic-name").as<string>();
+    worker_thread_num = options.at("kafka-plugin-worker-threads").as<uint32_t>();
+    uint32_t queue_size = options.at("kafka-plugin-queue-size").as<uint32_t>();
+    string queue_policy_name = options.at("kafka-plugin-queue-full-policy").as<string>();
+    uint32_t queue_grow_limit = options.at("kafka-plugin-queue-grow-limit").as<uint32_t>();
+    enable_backpressure = options.at("kafka-plugin-enable-backpressure").as<bool>();
+    uint32_t abi_cache_size = options.at("kafka-plugin-abi-cache-size").as<uint32_t>();
+    bool enable_idempotence = options.at("kafka-plugin-enable-idempotence").as<bool>();
+    string transactional_id = options.at("kafka-plugin-transactional-id").as<string>();
+    checkpoint_topic = options.at("kafka-plugin-checkpoint-topic-name").as<string>();
+    checkpoint_path = options.at("kafka-plugin-checkpoint-file").as<string>();
+    if (checkpoint_path.is_relative()) {
+        checkpoint_path = app().data_dir() / checkpoint_path;
+    }
+    stats_interval = options.at("kafka-plugin-stats-interval-sec").as<uint32_t>();
+    bool enable_spill = options.at("kafka-plugin-enable-spill").as<bool>();
+    boost::filesystem::path spill_dir = options.at("kafka-plugin-spill-dir").as<string>();
+    if (spill_dir.is_relative()) {
+        spill_dir = app().data_dir() / spill_dir;
+    }
+    uint64_t spill_segment_size = uint64_t(options.at("kafka-plugin-spill-segment-size-mb").as<uint32_t>()) * 1024 * 1024;
+    uint64_t spill_max_size = uint64_t(options.at("kafka-plugin-spill-max-size-mb").as<uint32_t>()) * 1024 * 1024;
     //check parameters, determin weather enable kafka_plugin
     if (!enable) return;
     if (brokers.size() == 0) {
         wlog ("enable kafka_plugin, but no broker addr found, kafka_plugin will be disabled");
+        enable = false;
         return;
     }
     if (enable_accepted_block_connection && accepted_block_topic_name == "") {
@@ -62,8 +360,33 @@ void kafka_plugin::plugin_initialize(const variables_map& options) {
     }
     if (!(enable_accepted_block_connection || enable_irreversible_block_connection || enable_applied_transaction_connection || enable_accepted_transaction_connection)) {
         wlog ("found kafka brokers,but no data stream avaliable, kafka_plugin will be disabled");
+        enable = false;
         return;
     }
+    if (worker_thread_num == 0) {
+        wlog ("kafka-plugin-worker-threads is 0, use 1 worker thread instead");
+        worker_thread_num = 1;
+    }
+    if (queue_size == 0) {
+        wlog ("kafka-plugin-queue-size is 0, use 1 instead");
+        queue_size = 1;
+    }
+    queue_full_policy queue_policy = queue_full_policy::block;
+    if (queue_policy_name == "drop-oldest") {
+        queue_policy = queue_full_policy::drop_oldest;
+    } else if (queue_policy_name == "grow") {
+        queue_policy = queue_full_policy::grow;
+    } else if (queue_policy_name != "block") {
+        wlog ("unknown kafka-plugin-queue-full-policy ${p}, use block instead", ("p", queue_policy_name));
+    }
+    if (queue_policy == queue_full_policy::grow && queue_grow_limit < queue_size) {
+        wlog ("kafka-plugin-queue-grow-limit is below kafka-plugin-queue-size, use ${n} instead", ("n", queue_size));
+        queue_grow_limit = queue_size;
+    }
+    job_queue = std::make_unique<bounded_queue<kafka_job> >(queue_size, queue_policy, queue_grow_limit);
+    job_queue->set_drop_handler([](kafka_job& job) {
+        ++job.topic->dropped;
+    });
     //create kafka producer
     cppkafka::Configuration kafka_config = {
         {"metadata.broker.list", boost::join(options.at("kafka-plugin-broker").as<vector<string> >(), ",")},
@@ -71,70 +394,1017 @@ void kafka_plugin::plugin_initialize(const variables_map& options) {
         {"request.required.acks", 1},
         {"compression.codec", "gzip"},
     };
-    kafka_producer = std::make_unique<cppkafka::Producer>(kafka_config);
-    auto conf = kafka_producer->get_configuration().get_all();
-    dlog ("Kafka config : ${conf}", ("conf", conf));
+    kafka_config.set_delivery_report_callback([this](cppkafka::Producer&, const cppkafka::Message& message) {
+        on_delivery_report(message);
+    });
+    kafka_config.set_error_callback([this](cppkafka::KafkaHandleBase&, int error, const std::string& reason) {
+        if (error == RD_KAFKA_RESP_ERR__ALL_BROKERS_DOWN) {
+            brokers_down = true;
+        }
+        elog ("kafka error : ${r}", ("r", reason));
+    });
+    if (enable_idempotence) {
+        kafka_config.set("enable.idempotence", "true");
+        kafka_config.set("request.required.acks", "all");
+    }
+    apply_config_option(kafka_config, "kafka-plugin-producer-config", parse_config_option(options, "kafka-plugin-producer-config"));
+    payload_pool = std::make_unique<buffer_pool>();
+    if (enable_spill) {
+        journal = std::make_unique<spill_journal>(spill_dir, spill_segment_size, spill_max_size);
+        ilog ("kafka spill journal in ${d} recovered ${n} messages", ("d", spill_dir.string())("n", journal->record_count()));
+    }
+    if (transactional_id != "" && !enable_irreversible_block_connection) {
+        wlog ("kafka-plugin-transactional-id is set, but data stream from irreversible_block is disabled, transactions will not be used");
+    }
+    //a stream's config is the common one plus its own overrides, the fingerprint tells which streams can share a producer
+    auto stream_config = [&kafka_config, &options](const string& stream, string& fingerprint) {
+        string producer_option = "kafka-plugin-" + stream + "-producer-config";
+        string topic_option = "kafka-plugin-" + stream + "-topic-config";
+        auto producer_items = parse_config_option(options, producer_option);
+        auto topic_items = parse_config_option(options, topic_option);
+        cppkafka::Configuration config = kafka_config;
+        apply_config_option(config, producer_option, producer_items);
+        fingerprint.clear();
+        for (const auto& item : producer_items) {
+            fingerprint += item.first + "=" + item.second + ";";
+        }
+        if (!topic_items.empty()) {
+            //librdkafka routes topic properties set on the global config to its default topic config.
+            //a separate TopicConfiguration would replace that one and lose acks and the inherited topic items
+            apply_config_option(config, topic_option, topic_items);
+            fingerprint += "|";
+            for (const auto& item : topic_items) {
+                fingerprint += item.first + "=" + item.second + ";";
+            }
+        }
+        return config;
+    };
+    auto make_producer = [](const cppkafka::Configuration& config) {
+        auto producer = std::make_unique<cppkafka::Producer>(config);
+        //payloads live in pooled buffers until their delivery report, librdkafka neither copies nor frees them
+        producer->set_payload_policy(cppkafka::Producer::PayloadPolicy::PASSTHROUGH_PAYLOAD);
+        auto conf = producer->get_configuration().get_all();
+        dlog ("Kafka config : ${conf}", ("conf", conf));
+        return producer;
+    };
+    //registe topics, std::map keeps their address stable for the queued jobs
+    auto add_topic = [&](const string& name, const string& stream, bool shared_producer) {
+        kafka_topic* topic = &topics[stream];
+        topic->stream = stream;
+        topic->name = name;
+        string format_option = "kafka-plugin-" + stream + "-format";
+        topic->format = parse_payload_format(format_option, options.at(format_option).as<string>());
+        string partitioner_option = "kafka-plugin-" + stream + "-partitioner";
+        topic->partitioner = parse_partitioner(partitioner_option, options.at(partitioner_option).as<string>());
+        if (shared_producer) {
+            string fingerprint;
+            cppkafka::Configuration config = stream_config(stream, fingerprint);
+            auto& producer = producers[fingerprint];
+            if (!producer) {
+                producer = make_producer(config);
+            }
+            topic->producer = producer.get();
+            topic->spill = bool(journal);
+        }
+        return topic;
+    };
+    abis = std::make_unique<abi_cache>(app().get_plugin<chain_plugin>().chain(), abi_cache_size, fc::seconds(10));
     //registe data stream
     auto& chain = app().get_plugin<chain_plugin>().chain();
     if (enable_accepted_block_connection) {
+        kafka_topic* accepted_block_topic = add_topic(accepted_block_topic_name, "accepted-block", true);
+        accepted_block_topic->split_blocks = options.at("kafka-plugin-accepted-block-split").as<bool>();
         on_accepted_block_connection = chain.accepted_block.connect([=](const block_state_ptr& block_state) {
-            produce_data (accepted_block_topic_name, block_state->id, block_state);
+            push_block (*accepted_block_topic, block_state);
+            if (!block_accounts_until_irreversible) {
+                release_block_accounts(block_state->block_num);
+            }
         });
     }
     if (enable_irreversible_block_connection) {
-        on_irreversible_block_connection = chain.irreversible_block.connect([=](const block_state_ptr& block_state) {
-            produce_data (irreversible_block_topic_name, block_state->id, block_state);
-        });
+        kafka_topic* irreversible_block_topic = add_topic(irreversible_block_topic_name, "irreversible-block", transactional_id == "");
+        irreversible_block_topic->split_blocks = options.at("kafka-plugin-irreversible-block-split").as<bool>();
+        if (transactional_id != "") {
+            //a producer with transactional.id only accepts messages inside a transaction, keep it for irreversible blocks
+            string fingerprint;
+            cppkafka::Configuration transactional_config = stream_config("irreversible-block", fingerprint);
+            transactional_config.set("transactional.id", transactional_id);
+            transactional_config.set("enable.idempotence", "true");
+            transactional_config.set("request.required.acks", "all");
+            transactional_producer = make_producer(transactional_config);
+            if (checkpoint_topic == "") {
+                checkpoint_topic = irreversible_block_topic_name + ".checkpoint";
+            }
+            checkpoint_key = transactional_id;
+            //read the checkpoint back as a consumer would, only what was committed
+            checkpoint_consumer_config = {
+                {"metadata.broker.list", boost::join(brokers, ",")},
+                {"group.id", transactional_id + ".checkpoint"},
+                {"enable.auto.commit", false},
+                {"enable.partition.eof", true},
+                {"isolation.level", "read_committed"},
+            };
+            apply_config_option(checkpoint_consumer_config, "kafka-plugin-producer-config", parse_config_option(options, "kafka-plugin-producer-config"));
+            //never block the chain thread, a block dropped here is fetched again from the block log by the gap check
+            transaction_queue = std::make_unique<bounded_queue<kafka_task> >(queue_size, queue_full_policy::drop_oldest);
+            load_checkpoint();
+            //a failed transaction is retried as a whole, its messages never go to the journal
+            irreversible_block_topic->producer = transactional_producer.get();
+            irreversible_block_topic->spill = false;
+            transactional_topic = irreversible_block_topic;
+            on_irreversible_block_connection = chain.irreversible_block.connect([=](const block_state_ptr& block_state) {
+                push_transactional_block (*irreversible_block_topic, block_state);
+                release_block_accounts(block_state->block_num);
+            });
+        } else {
+            on_irreversible_block_connection = chain.irreversible_block.connect([=](const block_state_ptr& block_state) {
+                push_block (*irreversible_block_topic, block_state);
+                release_block_accounts(block_state->block_num);
+            });
+        }
     }
+    kafka_topic* applied_transaction_topic = nullptr;
     if (enable_applied_transaction_connection) {
-        on_applied_transaction_connection = chain.applied_transaction.connect([=](const transaction_trace_ptr& transaction_trace) {
-            produce_data (applied_transaction_topic_name, transaction_trace->id, transaction_trace);
-        });
+        applied_transaction_topic = add_topic(applied_transaction_topic_name, "applied-transaction", true);
     }
     if (enable_accepted_transaction_connection) {
+        kafka_topic* accepted_transaction_topic = add_topic(accepted_transaction_topic_name, "accepted-transaction", true);
         on_accepted_transaction_connection = chain.accepted_transaction.connect([=](const transaction_metadata_ptr& transaction_metadata) {
-            produce_data (accepted_transaction_topic_name, transaction_metadata->id, transaction_metadata);
+            push_data (*accepted_transaction_topic, transaction_metadata->id, transaction_metadata);
         });
     }
+    for (auto& item : topics) {
+        kafka_topic& topic = item.second;
+        bool block_stream = topic.stream == "accepted-block" || topic.stream == "irreversible-block";
+        if (block_stream && !topic.split_blocks && topic.partitioner == kafka_partitioner::txid) {
+            wlog ("a block of topic ${t} has no transaction id, use the key partitioner instead of txid", ("t", topic.name));
+            topic.partitioner = kafka_partitioner::key;
+        }
+        if (topic.split_blocks && topic.format == kafka_payload_format::packed) {
+            wlog ("split messages of topic ${t} can not be told apart without envelope, use envelope format instead", ("t", topic.name));
+            topic.format = kafka_payload_format::envelope;
+        }
+        if (&topic == transactional_topic && topic.format == kafka_payload_format::packed) {
+            wlog ("caught up signed blocks of topic ${t} can not be told from block states without envelope, use envelope format instead", ("t", topic.name));
+            topic.format = kafka_payload_format::envelope;
+        }
+        if (topic.format == kafka_payload_format::json && block_stream) {
+            track_block_accounts = true;
+            block_accounts_until_irreversible = block_accounts_until_irreversible || topic.stream == "irreversible-block";
+        }
+    }
+    //json blocks take their abi accounts from the applied transactions instead of unpacking every transaction again
+    if (applied_transaction_topic != nullptr || track_block_accounts) {
+        on_applied_transaction_connection = chain.applied_transaction.connect([=](const transaction_trace_ptr& transaction_trace) {
+            if (track_block_accounts) {
+                record_block_accounts(transaction_trace);
+            }
+            if (applied_transaction_topic != nullptr) {
+                push_data (*applied_transaction_topic, transaction_trace->id, transaction_trace);
+            }
+        });
+    }
+    //start the threads last, nothing above may throw with a joinable thread around.
+    //still before any signal arrives, chain_plugin may replay blocks before our startup
+    for (uint32_t i = 0; i < worker_thread_num; i++) {
+        worker_threads.emplace_back([this] { worker_loop(); });
+    }
+    if (transaction_queue) {
+        transaction_thread = std::thread([this] { transaction_loop(); });
+    }
+    //the producers are fixed from here on
+    polling = true;
+    poll_thread = std::thread([this] { poll_loop(); });
+    threads_started = true;
 }
 
 void kafka_plugin::plugin_startup() {
     if (!enable) return;
+    if (transactional_topic != nullptr) {
+        //resume from the checkpoint on the transaction thread, the gap check of each block covers the rest
+        uint32_t lib = app().get_plugin<chain_plugin>().chain().last_irreversible_block_num();
+        kafka_topic* topic = transactional_topic;
+        transaction_queue->push([this, topic, lib]() {
+            catch_up_irreversible_blocks (*topic, lib);
+        });
+    }
+    if (journal) {
+        replaying = true;
+        replay_thread = std::thread([this] { replay_loop(); });
+    }
+    if (stats_interval > 0) {
+        stats_running = true;
+        stats_thread = std::thread([this] { stats_loop(); });
+    }
     ilog ("kafka_plugin startup");
 }
 
+kafka_plugin::~kafka_plugin() {
+    //appbase only shuts down started plugins, a failed startup of another plugin still destroys this one
+    stop();
+}
+
 void kafka_plugin::plugin_shutdown() {
     if (!enable) return;
-    //sometimes the flush will be failed, try more time will be usefull
-    for (int i = 0; i < 5; i++) {
+    stop();
+}
+
+void kafka_plugin::stop () {
+    if (!threads_started) return;
+    threads_started = false;
+    //no more backpressure waits, a message librdkafka can not take now goes to the journal or is dropped
+    stopping = true;
+    //stop receiving signals, then let the workers drain what is already queued
+    on_accepted_block_connection.disconnect();
+    on_irreversible_block_connection.disconnect();
+    on_applied_transaction_connection.disconnect();
+    on_accepted_transaction_connection.disconnect();
+    stats_running = false;
+    if (stats_thread.joinable()) {
+        stats_thread.join();
+    }
+    //pending irreversible blocks are left to the catch up after restart, the checkpoint tells where to resume
+    if (transaction_queue) {
+        transaction_stopping = true;
+        transaction_queue->close();
+        if (transaction_thread.joinable()) {
+            transaction_thread.join();
+        }
+    }
+    job_queue->close();
+    for (auto& worker : worker_threads) {
+        worker.join();
+    }
+    worker_threads.clear();
+    if (job_queue->dropped_count() > 0 || job_queue->grown_count() > 0) {
+        wlog ("kafka_plugin queue was full, dropped ${d} signals, queued ${g} signals past the capacity",
+              ("d", job_queue->dropped_count())("g", job_queue->grown_count()));
+    }
+    replaying = false;
+    if (replay_thread.joinable()) {
+        replay_thread.join();
+    }
+    for (auto& item : producers) {
+        auto& producer = item.second;
+        //sometimes the flush will be failed, try more time will be usefull
+        bool flushed = false;
+        for (int i = 0; i < 5 && !flushed; i++) {
+            try {
+                producer->flush();
+                ilog ("kafka producer flush finish");
+                flushed = true;
+            } catch (const std::exception& ex) {
+                elog ("std Exception when flush kafka producer : ${ex} try again(${i}/5)", ("ex", ex.what())("i", i));
+            }
+        }
+        if (!flushed && journal) {
+            //the purged messages come back as failed delivery reports and are spilled there
+            rd_kafka_purge(producer->get_handle(), RD_KAFKA_PURGE_F_QUEUE | RD_KAFKA_PURGE_F_INFLIGHT);
+            producer->poll(std::chrono::milliseconds(1000));
+        }
+    }
+    polling = false;
+    poll_thread.join();
+    transactional_producer.reset();
+    producers.clear();
+    log_stats();
+    if (journal) {
+        ilog ("kafka spill journal keeps ${n} messages for the next start", ("n", journal->record_count()));
+        journal.reset();
+    }
+    ilog ("kafka_plugin shutdown");
+}
+
+void kafka_plugin::worker_loop () {
+    //stamp while the job leaves the queue, so the sequences of a topic follow the queue order
+    auto stamp = [](kafka_job& job) { job.sequence = job.topic->next_sequence++; };
+    kafka_job job;
+    while (job_queue->pop(job, stamp)) {
+        kafka_batch batch;
+        //every stamped job must reach the reorder stage, otherwise its topic stalls behind it
+        catch_and_log(*job.topic, [&]() {
+            job.serialize(batch);
+        });
+        produce_in_order(*job.topic, job.sequence, std::move(batch));
+        job = kafka_job();
+    }
+}
+
+void kafka_plugin::transaction_loop () {
+    //the queue keeps the blocks meanwhile, nodeos does not wait for the transaction coordinator
+    if (!init_transactions() || !read_kafka_checkpoint()) return;
+    kafka_task task;
+    while (transaction_queue->pop(task)) {
+        task();
+        task = nullptr;
+    }
+}
+
+bool kafka_plugin::init_transactions () {
+    while (!transaction_stopping) {
         try {
-            kafka_producer->flush();
-            ilog ("kafka producer flush finish");
-            kafka_producer.reset();
-            break;
+            check_transaction_error(rd_kafka_init_transactions(transactional_producer->get_handle(), transaction_timeout_ms));
+            ilog ("kafka transactions initialized");
+            return true;
+        } catch (const kafka_transaction_exception& ex) {
+            if (ex.fatal) {
+                elog ("fatal error when init kafka transactions : ${ex}, irreversible blocks stop until restart", ("ex", ex.what()));
+                transaction_failed = true;
+                return false;
+            }
+            elog ("init kafka transactions failed : ${ex}, try again", ("ex", ex.what()));
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    return false;
+}
+
+void kafka_plugin::produce_in_order (kafka_topic& topic, uint64_t sequence, kafka_batch&& batch) {
+    std::lock_guard<std::mutex> lock(topic.reorder_mtx);
+    topic.reorder.emplace(sequence, std::move(batch));
+    //whoever completes the next sequence produces it and everything already waiting behind it
+    auto itr = topic.reorder.begin();
+    while (itr != topic.reorder.end() && itr->first == topic.next_produce) {
+        produce_batch(topic, itr->second);
+        ++topic.next_produce;
+        itr = topic.reorder.erase(itr);
+    }
+}
+
+void kafka_plugin::produce_batch (kafka_topic& topic, kafka_batch& batch) {
+    for (auto& message : batch) {
+        catch_and_log(topic, [&]() {
+            produce_serialized(topic, message);
+        });
+    }
+}
+
+void kafka_plugin::produce_serialized (kafka_topic& topic, kafka_message& message) {
+    cppkafka::Buffer key_kafka(message.key.data(), message.key.length());
+    cppkafka::Buffer payload_kafka(message.payload->data(), message.payload->size);
+    //keep the order, while the journal is not replayed yet new messages queue up behind it
+    if (topic.spill && !journal->empty()) {
+        spill_message(topic, message.partition, key_kafka, payload_kafka);
+        return;
+    }
+    try {
+        produce_message(topic, cppkafka::MessageBuilder(topic.name).key(key_kafka)
+                        .payload(payload_kafka).partition(message.partition).user_data(message.payload.get()));
+    } catch (const cppkafka::HandleException& ex) {
+        if (!topic.spill || !is_spillable(ex.get_error().get_error())) throw;
+        spill_message(topic, message.partition, key_kafka, payload_kafka);
+        return;
+    }
+    //librdkafka holds the payload now, the delivery report gives it back to the pool
+    message.payload.release();
+}
+
+void kafka_plugin::poll_loop () {
+    //split the wait among the producers, each one still gets polled about every 100ms
+    auto timeout = std::chrono::milliseconds(std::max<size_t>(1, 100 / std::max<size_t>(1, producers.size())));
+    while (polling) {
+        try {
+            for (auto& item : producers) {
+                item.second->poll(timeout);
+            }
+            if (transactional_producer) {
+                transactional_producer->poll(producers.empty() ? std::chrono::milliseconds(100) : std::chrono::milliseconds(0));
+            }
         } catch (const std::exception& ex) {
-            elog ("std Exception when flush kafka producer : ${ex} try again(${i}/5)", ("ex", ex.what())("i", i));
+            elog ("std Exception when poll kafka producer : ${ex}", ("ex", ex.what()));
         }
     }
-    ilog ("kafka_plugin shutdown");
+}
+
+void kafka_plugin::on_delivery_report (const cppkafka::Message& message) {
+    auto payload = static_cast<pooled_buffer*>(message.get_user_data());
+    if (payload == nullptr) return;
+    auto topic = static_cast<kafka_topic*>(payload->owner);
+    if (topic == nullptr) {
+        //a checkpoint record, a failure fails its transaction commit as well
+        if (message.get_error()) {
+            elog ("kafka checkpoint delivery failed : ${e}", ("e", message.get_error().to_string()));
+        }
+        payload_pool->release(payload);
+        return;
+    }
+    stats.ack.record_since(payload->produced_at);
+    if (message.get_error()) {
+        ++topic->failed;
+        elog ("kafka delivery failed on topic ${t} : ${e}", ("t", topic->name)("e", message.get_error().to_string()));
+        if (topic->spill && is_spillable(message.get_error().get_error())) {
+            try {
+                spill_message(*topic, message.get_partition(), message.get_key(), message.get_payload());
+            } catch (const std::exception& ex) {
+                elog ("std Exception when spill kafka message : ${ex}", ("ex", ex.what()));
+            }
+        }
+    } else {
+        ++topic->acked;
+        last_ack_ms = steady_ms();
+        brokers_down = false;
+    }
+    payload_pool->release(payload);
+}
+
+void kafka_plugin::produce_message (kafka_topic& topic, const cppkafka::MessageBuilder& builder) {
+    //count before produce, the delivery report may arrive before produce returns
+    ++topic.produced;
+    try {
+        produce_payload(*topic.producer, builder, enable_backpressure, stopping, stats);
+    } catch (...) {
+        --topic.produced;
+        throw;
+    }
+}
+
+int32_t kafka_plugin::partition_count (kafka_topic& topic) {
+    int32_t count = topic.partition_count;
+    if (count > 0) return count;
+    //don't block every message on the metadata request while the brokers are away
+    int64_t now = steady_ms();
+    if (now < topic.partition_count_retry) return 0;
+    topic.partition_count_retry = now + 10000;
+    try {
+        cppkafka::Topic handle = topic.producer->get_topic(topic.name);
+        count = topic.producer->get_metadata(handle).get_partitions().size();
+    } catch (const std::exception& ex) {
+        wlog ("can not get the partitions of topic ${t} : ${ex}, use the key partitioner until then", ("t", topic.name)("ex", ex.what()));
+        return 0;
+    }
+    if (count > 0) {
+        ilog ("kafka topic ${t} has ${n} partitions", ("t", topic.name)("n", count));
+        topic.partition_count = count;
+    }
+    return count;
+}
+
+void kafka_plugin::spill_message (kafka_topic& topic, int32_t partition, const cppkafka::Buffer& key, const cppkafka::Buffer& payload) {
+    //record the stream rather than the topic name, it tells which producer and settings the replay uses
+    if (!journal->append(topic.stream, partition, reinterpret_cast<const char*>(key.get_data()), key.get_size(),
+                         reinterpret_cast<const char*>(payload.get_data()), payload.get_size())) {
+        throw std::runtime_error("kafka spill journal is full");
+    }
+    ++topic.spilled;
+}
+
+void kafka_plugin::replay_loop () {
+    auto last_sync = std::chrono::steady_clock::now();
+    int64_t last_probe_ms = 0;
+    while (replaying) {
+        if (std::chrono::steady_clock::now() - last_sync > std::chrono::seconds(1)) {
+            journal->sync();
+            last_sync = std::chrono::steady_clock::now();
+        }
+        if (journal->empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        spill_record record;
+        if (!journal->front(record)) continue;
+        auto itr = topics.find(string(record.topic, record.topic_size));
+        if (itr == topics.end() || itr->second.producer == nullptr) {
+            wlog ("spilled message of unknown stream ${s} is dropped", ("s", string(record.topic, record.topic_size)));
+            journal->pop();
+            continue;
+        }
+        kafka_topic& topic = itr->second;
+        //replay only while the brokers take messages, a record sent into an outage times out and is spilled again
+        //at the tail, out of order. a recent ack proves it, otherwise probe with a metadata request
+        int64_t now = steady_ms();
+        if (brokers_down || (now - last_ack_ms > 5000 && now - last_probe_ms > 5000)) {
+            try {
+                topic.producer->get_metadata(false);
+            } catch (const std::exception&) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            last_probe_ms = now;
+            if (brokers_down) {
+                brokers_down = false;
+                ilog ("kafka brokers are back, replay ${n} spilled messages", ("n", journal->record_count()));
+            }
+        }
+        pooled_buffer_ptr payload(payload_pool->acquire(record.payload_size), pooled_buffer_deleter{payload_pool.get()});
+        std::memcpy(payload->data(), record.payload, record.payload_size);
+        payload->size = record.payload_size;
+        payload->owner = &topic;
+        try {
+            produce_message(topic, cppkafka::MessageBuilder(topic.name).key(cppkafka::Buffer(record.key, record.key_size))
+                            .payload(cppkafka::Buffer(payload->data(), payload->size)).partition(record.partition).user_data(payload.get()));
+            payload.release();
+            journal->pop();
+            ++topic.replayed;
+        } catch (const cppkafka::HandleException& ex) {
+            if (is_spillable(ex.get_error().get_error())) {
+                //still unreachable, keep the record and try again later
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                continue;
+            }
+            elog ("spilled message of topic ${t} is dropped : ${ex}", ("t", topic.name)("ex", ex.what()));
+            ++topic.dropped;
+            journal->pop();
+        }
+    }
+}
+
+void kafka_plugin::log_stats () {
+    for (const auto& item : topics) {
+        const kafka_topic& topic = item.second;
+        ilog ("kafka topic ${t} of ${st} : produced ${p}, acked ${a}, failed ${f}, in flight ${i}, dropped ${d}, spilled ${s}, replayed ${r}",
+              ("t", topic.name)("st", topic.stream)("p", topic.produced.load())("a", topic.acked.load())
+              ("f", topic.failed.load())("i", topic.in_flight())("d", topic.dropped.load())
+              ("s", topic.spilled.load())("r", topic.replayed.load()));
+    }
+    ilog ("kafka queue : ${q} signals waiting, ${d} dropped, ${g} queued past the capacity",
+          ("q", job_queue->size())("d", job_queue->dropped_count())("g", job_queue->grown_count()));
+    if (transaction_queue) {
+        ilog ("kafka transaction queue : ${q} irreversible blocks waiting, last committed ${n}",
+              ("q", transaction_queue->size())("n", last_committed_block.load()));
+    }
+    if (journal) {
+        ilog ("kafka spill journal : ${n} messages, ${s} bytes", ("n", journal->record_count())("s", journal->size()));
+    }
+    ilog ("kafka stage handoff : ${s}", ("s", stats.handoff.summary()));
+    ilog ("kafka stage abi decode : ${s}", ("s", stats.abi_decode.summary()));
+    ilog ("kafka stage json : ${s}", ("s", stats.json.summary()));
+    ilog ("kafka stage pack : ${s}", ("s", stats.pack.summary()));
+    ilog ("kafka stage enqueue : ${s}", ("s", stats.enqueue.summary()));
+    ilog ("kafka stage ack : ${s}", ("s", stats.ack.summary()));
+    ilog ("kafka payload pool : ${a} allocations, ${r} reuses, ${c} bytes copied when growing",
+          ("a", payload_pool->allocation_count())("r", payload_pool->reuse_count())("c", payload_pool->copied_bytes()));
+    ilog ("kafka abi cache : ${h} hits, ${m} misses, ${e} evictions",
+          ("h", abis->hit_count())("m", abis->miss_count())("e", abis->eviction_count()));
+}
+
+void kafka_plugin::stats_loop () {
+    auto last_log = std::chrono::steady_clock::now();
+    while (stats_running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (std::chrono::steady_clock::now() - last_log < std::chrono::seconds(stats_interval)) continue;
+        last_log = std::chrono::steady_clock::now();
+        log_stats();
+    }
+}
+
+template <typename OBJ>
+abi_snapshot_ptr kafka_plugin::snapshot_abis (const kafka_topic& topic, const OBJ& obj) {
+    //packed payloads never look at an abi
+    if (topic.format != kafka_payload_format::json) return abi_snapshot_ptr();
+    auto snapshot = std::make_shared<abi_snapshot>();
+    collect_object_abis(*snapshot, obj);
+    return snapshot;
+}
+
+template <typename OBJ>
+void kafka_plugin::collect_object_abis (abi_snapshot& snapshot, const OBJ& obj) {
+    collect_abis(*abis, snapshot, obj);
+}
+
+void kafka_plugin::collect_object_abis (abi_snapshot& snapshot, const block_state_ptr& block_state) {
+    collect_object_abis(snapshot, *block_state->block);
+}
+
+void kafka_plugin::collect_object_abis (abi_snapshot& snapshot, const signed_block& block) {
+    //the applied transactions of the block already named the accounts, no need to unpack every transaction again
+    auto itr = block_accounts.find(block.block_num());
+    if (itr != block_accounts.end()) {
+        for (const auto& account : itr->second) {
+            abis->snapshot(snapshot, account);
+        }
+        return;
+    }
+    //caught up from the block log, or applied before the plugin listened
+    collect_abis(*abis, snapshot, block);
+}
+
+//top level actions are the ones a block carries, a fork or a dropped speculative transaction only adds accounts
+void kafka_plugin::record_block_accounts (const transaction_trace_ptr& transaction_trace) {
+    auto& accounts = block_accounts[transaction_trace->block_num];
+    for (const auto& trace : transaction_trace->action_traces) {
+        accounts.insert(trace.act.account);
+    }
+}
+
+void kafka_plugin::release_block_accounts (uint32_t block_num) {
+    block_accounts.erase(block_accounts.begin(), block_accounts.upper_bound(block_num));
 }
 
 template <typename KEY, typename OBJ>
-void kafka_plugin::produce_data (const string& topic, const KEY& key, const OBJ& obj, int partition) {
-    try{
-        string key_str = string(key);
-        cppkafka::Buffer key_kafka(key_str.data(), key_str.length());
-        auto tvariant = app().get_plugin<chain_plugin>()
-            .chain().to_variant_with_abi(obj, fc::seconds(10));
-        auto payload = fc::json::to_string(tvariant, fc::json::legacy_generator);
-        kafka_producer->produce(cppkafka::MessageBuilder(topic).key(key_kafka).payload(payload).partition(partition));
+void kafka_plugin::push_data (kafka_topic& topic, const KEY& key, const OBJ& obj) {
+    //runs on the chain thread, take everything the workers need from the chain state now and hand it off
+    uint64_t begin = latency_histogram::now();
+    invalidate_abis(*abis, obj);
+    OBJ data = detach(obj);
+    abi_snapshot_ptr snapshot = snapshot_abis(topic, data);
+    job_queue->push(kafka_job{&topic, 0, [this, &topic, key, data, snapshot](kafka_batch& batch) {
+        serialize_data (topic, key, data, snapshot, batch);
+    }});
+    stats.handoff.record_since(begin);
+}
+
+void kafka_plugin::push_block (kafka_topic& topic, const block_state_ptr& block_state) {
+    if (!topic.split_blocks) {
+        push_data (topic, block_state->id, block_state);
+        return;
+    }
+    //a split block only reads the signed block, which never changes
+    uint64_t begin = latency_histogram::now();
+    signed_block_ptr block = block_state->block;
+    abi_snapshot_ptr snapshot = snapshot_abis(topic, *block);
+    job_queue->push(kafka_job{&topic, 0, [this, &topic, block, snapshot](kafka_batch& batch) {
+        serialize_split_block (topic, block, snapshot, true, batch);
+    }});
+    stats.handoff.record_since(begin);
+}
+
+void kafka_plugin::serialize_split_block (kafka_topic& topic, const signed_block_ptr& block, const abi_snapshot_ptr& snapshot, bool fan_out,
+                                          kafka_batch& batch) {
+    const auto& transactions = block->transactions;
+    catch_and_log(topic, [&]() {
+        kafka_block_header header;
+        header.block_num = block->block_num();
+        header.block_id = block->id();
+        header.header = *block;
+        header.transaction_count = transactions.size();
+        serialize_value(topic, string(header.block_id), make_envelope(kafka_payload_type::block_header, header.block_num),
+                        header, snapshot, batch, "block_header");
+    });
+    if (!fan_out) {
+        serialize_block_transactions (topic, block, snapshot, 0, transactions.size(), batch);
+        return;
+    }
+    //fan the transactions out to the other workers, force_push since a worker must never wait on its own queue
+    size_t unqueued = transactions.size();
+    for (size_t begin = split_chunk_size; begin < transactions.size(); begin += split_chunk_size) {
+        size_t end = std::min(begin + split_chunk_size, transactions.size());
+        bool queued = job_queue->force_push(kafka_job{&topic, 0, [this, &topic, block, snapshot, begin, end](kafka_batch& batch) {
+            serialize_block_transactions (topic, block, snapshot, begin, end, batch);
+        }});
+        if (!queued) {
+            //the queue closed under us while shutting down, keep the rest of the block in this job
+            unqueued = begin;
+            break;
+        }
+    }
+    serialize_block_transactions (topic, block, snapshot, 0, std::min(split_chunk_size, transactions.size()), batch);
+    serialize_block_transactions (topic, block, snapshot, unqueued, transactions.size(), batch);
+}
+
+void kafka_plugin::serialize_block_transactions (kafka_topic& topic, const signed_block_ptr& block, const abi_snapshot_ptr& snapshot,
+                                                 size_t begin, size_t end, kafka_batch& batch) {
+    const auto& transactions = block->transactions;
+    const uint32_t block_num = block->block_num();
+    const block_id_type block_id = block->id();
+    for (size_t i = begin; i < end; i++) {
+        catch_and_log(topic, [&]() {
+            kafka_block_transaction trx_message;
+            trx_message.block_num = block_num;
+            trx_message.block_id = block_id;
+            trx_message.ordinal = i;
+            trx_message.receipt = transactions[i];
+            transaction_id_type trx_id;
+            vector<action> actions;
+            if (trx_message.receipt.trx.contains<packed_transaction>()) {
+                const auto& packed_trx = trx_message.receipt.trx.get<packed_transaction>();
+                trx_id = packed_trx.id();
+                actions = packed_trx.get_transaction().actions;
+            } else {
+                trx_id = trx_message.receipt.trx.get<transaction_id_type>();
+            }
+            trx_message.action_count = actions.size();
+            //key by transaction id so the transaction and its actions land on the same partition
+            string key = string(trx_id);
+            serialize_value(topic, key, make_envelope(kafka_payload_type::block_transaction, trx_message.block_num, i),
+                            trx_message, snapshot, batch, "block_transaction");
+            for (size_t j = 0; j < actions.size(); j++) {
+                kafka_block_action action_message;
+                action_message.block_num = trx_message.block_num;
+                action_message.block_id = trx_message.block_id;
+                action_message.trx_id = trx_id;
+                action_message.transaction_ordinal = i;
+                action_message.ordinal = j;
+                action_message.act = std::move(actions[j]);
+                serialize_value(topic, key, make_envelope(kafka_payload_type::block_action, action_message.block_num, j),
+                                action_message, snapshot, batch, "block_action");
+            }
+        });
+    }
+}
+
+void kafka_plugin::load_checkpoint () {
+    if (!fc::exists(checkpoint_path)) {
+        ilog ("no kafka checkpoint found in ${p}, start from the next irreversible block", ("p", checkpoint_path.string()));
+        return;
+    }
+    try {
+        checkpoint = fc::json::from_file(checkpoint_path).as<kafka_checkpoint>();
+    } catch (const fc::exception& ex) {
+        elog ("kafka checkpoint ${p} can not be read, fix or remove it : ${ex}", ("p", checkpoint_path.string())("ex", ex.to_detail_string()));
+        throw;
+    }
+    last_committed_block = checkpoint.block_num;
+    ilog ("kafka checkpoint loaded, last committed irreversible block ${n}", ("n", checkpoint.block_num));
+}
+
+//the checkpoint topic is the source of truth, the file only covers a topic that has no checkpoint of ours yet.
+//runs after init_transactions, which aborted any open transaction, so read_committed reads up to the end
+bool kafka_plugin::read_kafka_checkpoint () {
+    while (!transaction_stopping) {
+        try {
+            cppkafka::Consumer consumer(checkpoint_consumer_config);
+            consumer.set_timeout(std::chrono::milliseconds(transaction_timeout_ms));
+            cppkafka::TopicPartition partition(checkpoint_topic, 0);
+            int64_t low, high;
+            std::tie(low, high) = consumer.query_offsets(partition);
+            kafka_checkpoint latest;
+            bool found = false;
+            //every commit adds a record and a control marker, look at the tail first and read the whole partition only if needed
+            for (int64_t begin = std::max(low, high - 256); !found; begin = low) {
+                consumer.assign({cppkafka::TopicPartition(checkpoint_topic, 0, begin)});
+                while (true) {
+                    cppkafka::Message message = consumer.poll();
+                    if (!message) {
+                        throw std::runtime_error("timeout when read kafka checkpoint topic " + checkpoint_topic);
+                    }
+                    if (message.is_eof()) break;
+                    if (message.get_error()) {
+                        throw std::runtime_error(message.get_error().to_string());
+                    }
+                    if (string(message.get_key()) != checkpoint_key) continue;
+                    latest = fc::json::from_string(string(message.get_payload())).as<kafka_checkpoint>();
+                    found = true;
+                }
+                consumer.unassign();
+                if (begin == low) break;
+            }
+            if (found) {
+                if (latest.block_num != checkpoint.block_num) {
+                    wlog ("kafka checkpoint file says block ${f}, kafka topic ${t} says ${k}, resume from kafka",
+                          ("f", checkpoint.block_num)("t", checkpoint_topic)("k", latest.block_num));
+                }
+                checkpoint = latest;
+                last_committed_block = checkpoint.block_num;
+                save_checkpoint();
+            } else if (checkpoint.block_num != 0) {
+                wlog ("no checkpoint in kafka topic ${t}, resume from the checkpoint file", ("t", checkpoint_topic));
+            }
+            ilog ("kafka checkpoint read, last committed irreversible block ${n}", ("n", checkpoint.block_num));
+            return true;
+        } catch (const fc::exception& ex) {
+            elog ("fc Exception when read kafka checkpoint topic ${t} : ${ex}, try again", ("t", checkpoint_topic)("ex", ex.to_detail_string()));
+        } catch (const std::exception& ex) {
+            elog ("std Exception when read kafka checkpoint topic ${t} : ${ex}, try again", ("t", checkpoint_topic)("ex", ex.what()));
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    return false;
+}
+
+//one record per transactional id on partition 0, a compacted topic keeps only the latest
+void kafka_plugin::produce_checkpoint (kafka_topic& topic, const kafka_checkpoint& next) {
+    string content = fc::json::to_string(next);
+    pooled_buffer_ptr payload(payload_pool->acquire(content.size()), pooled_buffer_deleter{payload_pool.get()});
+    std::memcpy(payload->data(), content.data(), content.size());
+    payload->size = content.size();
+    //no owner, the delivery report only returns it to the pool
+    payload->owner = nullptr;
+    produce_payload(*topic.producer, cppkafka::MessageBuilder(checkpoint_topic).key(cppkafka::Buffer(checkpoint_key.data(), checkpoint_key.size()))
+                    .payload(cppkafka::Buffer(payload->data(), payload->size)).partition(0).user_data(payload.get()),
+                    enable_backpressure, stopping, stats);
+    payload.release();
+}
+
+void kafka_plugin::save_checkpoint () {
+    //write, fsync then rename, a crash never leaves a truncated or empty checkpoint behind
+    try {
+        string tmp_path = checkpoint_path.string() + ".tmp";
+        string content = fc::json::to_string(checkpoint);
+        FILE* file = std::fopen(tmp_path.c_str(), "wb");
+        if (file == nullptr) {
+            throw std::runtime_error("can not open " + tmp_path);
+        }
+        bool written = std::fwrite(content.data(), 1, content.size(), file) == content.size()
+            && std::fflush(file) == 0 && ::fsync(fileno(file)) == 0;
+        std::fclose(file);
+        if (!written) {
+            throw std::runtime_error("can not write " + tmp_path);
+        }
+        fc::rename(tmp_path, checkpoint_path);
+    } catch (const fc::exception& ex) {
+        elog ("fc Exception when save kafka checkpoint : ${ex}", ("ex", ex.to_detail_string()));
     } catch (const std::exception& ex) {
-        elog ("std Exception in data_plugin when accept block : ${ex}", ("ex", ex.what()));
-    } catch ( fc::exception& ex) {
-        wlog( "fc Exception in data_plugin when accept block : ${ex}", ("ex", ex.to_detail_string()) );
-    } catch (...) {
-        elog ("Unknown Exception in data_plugin when accept block");
+        elog ("std Exception when save kafka checkpoint : ${ex}", ("ex", ex.what()));
+    }
+}
+
+//runs on the transaction thread, produce every block after the checkpoint up to last from the block log
+void kafka_plugin::catch_up_irreversible_blocks (kafka_topic& topic, uint32_t last) {
+    uint32_t done = checkpoint.block_num;
+    if (done == 0) {
+        //nothing was ever committed, start from the first block this run emitted instead of the whole chain
+        uint32_t first = first_irreversible_block;
+        if (first == 0) return;
+        done = first - 1;
+    }
+    if (done >= last) return;
+    ilog ("kafka catch up irreversible blocks ${b} to ${e} from the block log", ("b", done + 1)("e", last));
+    for (uint32_t block_num = done + 1; block_num <= last; block_num++) {
+        if (transaction_stopping || transaction_failed) return;
+        signed_block_ptr block;
+        abi_snapshot_ptr snapshot;
+        if (!fetch_irreversible_block(topic, block_num, block, snapshot)) return;
+        if (!block) {
+            elog ("block ${n} not found in the block log, kafka catch up stops here", ("n", block_num));
+            return;
+        }
+        produce_transactional_block (topic, block, block_state_ptr(), snapshot);
+    }
+}
+
+//the block log and the abis belong to the chain thread, post the read there and wait for it on the transaction thread.
+//a caught up block is decoded with the abis current when it is fetched, the ones active back then are gone
+bool kafka_plugin::fetch_irreversible_block (kafka_topic& topic, uint32_t block_num, signed_block_ptr& block, abi_snapshot_ptr& snapshot) {
+    auto fetched = std::make_shared<std::promise<std::pair<signed_block_ptr, abi_snapshot_ptr> > >();
+    auto result = fetched->get_future();
+    app().get_io_service().post([this, &topic, block_num, fetched]() {
+        try {
+            signed_block_ptr block = app().get_plugin<chain_plugin>().chain().fetch_block_by_number(block_num);
+            fetched->set_value(std::make_pair(block, block ? snapshot_abis(topic, *block) : abi_snapshot_ptr()));
+        } catch (...) {
+            fetched->set_exception(std::current_exception());
+        }
+    });
+    //the chain thread stops serving posts once nodeos shuts down
+    while (result.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+        if (transaction_stopping) return false;
+    }
+    try {
+        std::tie(block, snapshot) = result.get();
+        return true;
+    } catch (const fc::exception& ex) {
+        elog ("fc Exception when fetch block ${n} : ${ex}", ("n", block_num)("ex", ex.to_detail_string()));
+    } catch (const std::exception& ex) {
+        elog ("std Exception when fetch block ${n} : ${ex}", ("n", block_num)("ex", ex.what()));
     }
+    return false;
+}
+
+void kafka_plugin::push_transactional_block (kafka_topic& topic, const block_state_ptr& block_state) {
+    //runs on the chain thread and never waits, whatever is missed here the next block's gap check fetches from the block log
+    uint64_t begin = latency_histogram::now();
+    signed_block_ptr block = block_state->block;
+    if (first_irreversible_block == 0) {
+        first_irreversible_block = block->block_num();
+    }
+    block_state_ptr data = topic.split_blocks ? block_state_ptr() : detach(block_state);
+    abi_snapshot_ptr snapshot = snapshot_abis(topic, *block);
+    transaction_queue->push([this, &topic, block, data, snapshot]() {
+        //startup may emit this block before the catch up ran, a full queue may have dropped its predecessors
+        catch_up_irreversible_blocks (topic, block->block_num() - 1);
+        produce_transactional_block (topic, block, data, snapshot);
+    });
+    stats.handoff.record_since(begin);
+}
+
+void kafka_plugin::produce_transactional_block (kafka_topic& topic, const signed_block_ptr& block, const block_state_ptr& block_state,
+                                                const abi_snapshot_ptr& snapshot) {
+    uint32_t block_num = block->block_num();
+    if (transaction_failed || block_num <= checkpoint.block_num) return;
+    block_id_type block_id = block->id();
+    rd_kafka_t* handle = topic.producer->get_handle();
+    uint32_t serialize_failures = 0;
+    while (!transaction_stopping) {
+        uint64_t dropped = topic.dropped;
+        bool abort = false;
+        try {
+            check_transaction_error(rd_kafka_begin_transaction(handle));
+            kafka_batch batch;
+            if (topic.split_blocks) {
+                serialize_split_block (topic, block, snapshot, false, batch);
+            } else if (block_state) {
+                serialize_data (topic, block_state->id, block_state, snapshot, batch);
+            } else {
+                //caught up from the block log, only the signed block is avaliable, the README describes this second shape
+                catch_and_log(topic, [&]() {
+                    serialize_value(topic, string(block_id), make_envelope(kafka_payload_type::signed_block, block_num),
+                                    *block, snapshot, batch, "signed_block");
+                });
+            }
+            if (topic.dropped != dropped) {
+                if (++serialize_failures < transaction_serialize_attempts) {
+                    throw std::runtime_error("message of the block not serialized");
+                }
+                elog ("block ${n} can not be serialized, skipped, only its checkpoint is committed", ("n", block_num));
+                batch.clear();
+                dropped = topic.dropped;
+            }
+            produce_batch (topic, batch);
+            if (topic.dropped != dropped) {
+                throw std::runtime_error("message dropped before the transaction commit");
+            }
+            //the resume point is committed together with the block, a crash can never separate them
+            kafka_checkpoint next;
+            next.block_num = block_num;
+            next.block_id = block_id;
+            produce_checkpoint(topic, next);
+            retry_transaction_call([handle]() {
+                return rd_kafka_commit_transaction(handle, transaction_timeout_ms);
+            });
+            checkpoint = next;
+            save_checkpoint();
+            last_committed_block = block_num;
+            return;
+        } catch (const kafka_transaction_exception& ex) {
+            if (ex.fatal) {
+                elog ("fatal kafka transaction error on block ${n} : ${ex}, irreversible blocks stop until restart", ("n", block_num)("ex", ex.what()));
+                transaction_failed = true;
+                return;
+            }
+            //only an abortable error rolls the block back, anything else left no transaction open
+            abort = ex.requires_abort;
+            elog ("kafka transaction of block ${n} failed : ${ex}, ${a}", ("n", block_num)("ex", ex.what())
+                  ("a", abort ? "abort and retry" : "retry"));
+        } catch (const std::exception& ex) {
+            //our own error after begin, the messages produced so far must not be committed
+            abort = true;
+            elog ("kafka transaction of block ${n} failed : ${ex}, abort and retry", ("n", block_num)("ex", ex.what()));
+        }
+        if (transaction_stopping) return;
+        if (abort) {
+            try {
+                retry_transaction_call([handle]() {
+                    return rd_kafka_abort_transaction(handle, transaction_timeout_ms);
+                });
+            } catch (const kafka_transaction_exception& ex) {
+                if (ex.fatal) {
+                    elog ("fatal error when abort kafka transaction : ${ex}, irreversible blocks stop until restart", ("ex", ex.what()));
+                    transaction_failed = true;
+                    return;
+                }
+                elog ("abort kafka transaction failed : ${ex}", ("ex", ex.what()));
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+//commit and abort must be called again after a retriable error, until then the transaction may or may not be done
+void kafka_plugin::retry_transaction_call (const std::function<rd_kafka_error_t*()>& call) {
+    while (true) {
+        try {
+            check_transaction_error(call());
+            return;
+        } catch (const kafka_transaction_exception& ex) {
+            if (!ex.retriable || transaction_stopping) throw;
+            wlog ("kafka transaction call failed : ${ex}, try again", ("ex", ex.what()));
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+}
+
+template <typename KEY, typename OBJ>
+void kafka_plugin::serialize_data (kafka_topic& topic, const KEY& key, const OBJ& obj, const abi_snapshot_ptr& snapshot, kafka_batch& batch) {
+    catch_and_log(topic, [&]() {
+        serialize_value(topic, string(key), make_envelope(payload_type(obj), payload_block_num(obj)), *obj, snapshot, batch);
+    });
+}
+
+template <typename VALUE>
+int32_t kafka_plugin::select_partition (kafka_topic& topic, const string& key, const VALUE& value) {
+    if (topic.partitioner == kafka_partitioner::key) return RD_KAFKA_PARTITION_UA;
+    int32_t count = partition_count(topic);
+    if (count <= 0) return RD_KAFKA_PARTITION_UA;
+    if (topic.partitioner == kafka_partitioner::block_num) {
+        uint32_t block_num = partition_block_num(value);
+        if (block_num != 0) return block_num % count;
+    } else if (topic.partitioner == kafka_partitioner::account) {
+        account_name account = partition_account(value);
+        if (account.value != 0) {
+            return fc::city_hash64(reinterpret_cast<const char*>(&account.value), sizeof(account.value)) % count;
+        }
+    } else if (topic.partitioner == kafka_partitioner::txid) {
+        transaction_id_type trx_id = partition_txid(value);
+        if (trx_id != transaction_id_type()) {
+            return fc::city_hash64(trx_id.data(), trx_id.data_size()) % count;
+        }
+    }
+    //the key is the transaction id, or the block id for block messages
+    return fc::city_hash64(key.data(), key.size()) % count;
+}
+
+template <typename VALUE>
+void kafka_plugin::serialize_value (kafka_topic& topic, const string& key, kafka_envelope envelope, const VALUE& value,
+                                    const abi_snapshot_ptr& snapshot, kafka_batch& batch, const char* json_type) {
+    kafka_message message;
+    message.partition = select_partition(topic, key, value);
+    message.key = key;
+    message.payload = topic.format == kafka_payload_format::json
+        ? serialize_json(*payload_pool, topic.payload_size_hint, value, *snapshot, json_type, stats)
+        : serialize_packed(*payload_pool, topic.format, envelope, value, stats);
+    message.payload->owner = &topic;
+    topic.payload_size_hint = message.payload->size;
+    batch.push_back(std::move(message));
 }
 
 }
@@ -0,0 +1,237 @@
+#include <eosio/kafka_plugin/spill_journal.hpp>
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+
+namespace eosio {
+
+namespace bfs = boost::filesystem;
+namespace bip = boost::interprocess;
+
+//segment header : magic(8) version(4) reserved(4) read_offset(8) reserved(8)
+static const uint64_t segment_magic = 0x4c50534b464b4f45ULL;
+static const uint32_t segment_version = 1;
+static const uint64_t read_offset_pos = 16;
+static const uint64_t segment_header_size = 32;
+//record header : magic(4) crc(4) partition(4) topic_size(4) key_size(4) payload_size(4), crc covers everything after itself
+static const uint32_t record_magic = 0x4b52534aU;
+static const uint64_t record_header_size = 24;
+
+template <typename T>
+static T load (const char* pos) {
+    T value;
+    std::memcpy(&value, pos, sizeof(T));
+    return value;
+}
+
+template <typename T>
+static void store (char* pos, T value) {
+    std::memcpy(pos, &value, sizeof(T));
+}
+
+static bfs::path segment_path (const bfs::path& dir, uint64_t sequence) {
+    char name[64];
+    std::snprintf(name, sizeof(name), "segment-%016llu.log", (unsigned long long)sequence);
+    return dir / name;
+}
+
+spill_journal::spill_journal (const bfs::path& dir, uint64_t segment_size, uint64_t max_size)
+    : dir(dir), segment_size(segment_size), max_size(max_size) {
+    bfs::create_directories(dir);
+    recover();
+}
+
+spill_journal::~spill_journal () {
+    sync();
+}
+
+std::unique_ptr<spill_journal::segment> spill_journal::open_segment (const bfs::path& path, uint64_t sequence) const {
+    auto seg = std::make_unique<segment>();
+    seg->sequence = sequence;
+    seg->path = path;
+    seg->file = bip::file_mapping(path.string().c_str(), bip::read_write);
+    seg->region = bip::mapped_region(seg->file, bip::read_write);
+    return seg;
+}
+
+std::unique_ptr<spill_journal::segment> spill_journal::create_segment (uint64_t sequence, uint64_t capacity) const {
+    bfs::path path = segment_path(dir, sequence);
+    {
+        std::ofstream out(path.string(), std::ios::binary | std::ios::trunc);
+    }
+    bfs::resize_file(path, capacity);
+    auto seg = open_segment(path, sequence);
+    store<uint64_t>(seg->data(), segment_magic);
+    store<uint32_t>(seg->data() + 8, segment_version);
+    store<uint64_t>(seg->data() + read_offset_pos, segment_header_size);
+    seg->read_offset = segment_header_size;
+    seg->write_offset = segment_header_size;
+    return seg;
+}
+
+bool spill_journal::read_record (const segment& seg, uint64_t offset, spill_record& record, uint64_t& next) const {
+    if (offset + record_header_size > seg.capacity()) return false;
+    const char* pos = seg.data() + offset;
+    if (load<uint32_t>(pos) != record_magic) return false;
+    uint32_t crc = load<uint32_t>(pos + 4);
+    int32_t partition = load<int32_t>(pos + 8);
+    uint64_t topic_size = load<uint32_t>(pos + 12);
+    uint64_t key_size = load<uint32_t>(pos + 16);
+    uint64_t payload_size = load<uint32_t>(pos + 20);
+    uint64_t end = offset + record_header_size + topic_size + key_size + payload_size;
+    if (end > seg.capacity()) return false;
+    boost::crc_32_type checksum;
+    checksum.process_bytes(pos + 8, end - offset - 8);
+    if (checksum.checksum() != crc) return false;
+    record.topic = pos + record_header_size;
+    record.topic_size = topic_size;
+    record.partition = partition;
+    record.key = record.topic + topic_size;
+    record.key_size = key_size;
+    record.payload = record.key + key_size;
+    record.payload_size = payload_size;
+    next = end;
+    return true;
+}
+
+void spill_journal::store_read_offset (segment& seg) const {
+    store<uint64_t>(seg.data() + read_offset_pos, seg.read_offset);
+}
+
+void spill_journal::recover () {
+    std::vector<std::pair<uint64_t, bfs::path> > files;
+    for (bfs::directory_iterator itr(dir); itr != bfs::directory_iterator(); ++itr) {
+        unsigned long long sequence = 0;
+        if (std::sscanf(itr->path().filename().string().c_str(), "segment-%llu.log", &sequence) == 1) {
+            files.emplace_back(sequence, itr->path());
+        }
+    }
+    std::sort(files.begin(), files.end());
+    for (const auto& file : files) {
+        auto seg = open_segment(file.second, file.first);
+        if (seg->capacity() < segment_header_size || load<uint64_t>(seg->data()) != segment_magic
+            || load<uint32_t>(seg->data() + 8) != segment_version) {
+            seg.reset();
+            bfs::rename(file.second, file.second.string() + ".corrupted");
+            continue;
+        }
+        seg->read_offset = std::max(load<uint64_t>(seg->data() + read_offset_pos), segment_header_size);
+        //scan every record, the first one failing its crc is where the writer stopped
+        uint64_t offset = segment_header_size;
+        spill_record record;
+        uint64_t next = 0;
+        while (read_record(*seg, offset, record, next)) {
+            if (offset >= seg->read_offset) ++records;
+            offset = next;
+        }
+        seg->write_offset = offset;
+        seg->read_offset = std::min(seg->read_offset, seg->write_offset);
+        //wipe what follows, a later crash must not expose stale records behind new ones
+        std::memset(seg->data() + offset, 0, seg->capacity() - offset);
+        total_size += seg->capacity();
+        segments.emplace_back(std::move(seg));
+    }
+    while (segments.size() > 1 && segments.front()->read_offset == segments.front()->write_offset) {
+        remove_front();
+    }
+}
+
+void spill_journal::remove_front () {
+    auto seg = std::move(segments.front());
+    segments.pop_front();
+    total_size -= seg->capacity();
+    bfs::path path = seg->path;
+    seg.reset();
+    bfs::remove(path);
+}
+
+bool spill_journal::append (const std::string& topic, int32_t partition, const char* key, size_t key_size, const char* payload, size_t payload_size) {
+    uint64_t record_size = record_header_size + topic.size() + key_size + payload_size;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (segments.empty() || segments.back()->write_offset + record_size > segments.back()->capacity()) {
+        uint64_t capacity = std::max(segment_size, segment_header_size + record_size);
+        if (total_size + capacity > max_size) return false;
+        uint64_t sequence = segments.empty() ? 0 : segments.back()->sequence + 1;
+        if (!segments.empty()) {
+            segments.back()->region.flush();
+        }
+        segments.emplace_back(create_segment(sequence, capacity));
+        total_size += capacity;
+    }
+    segment& seg = *segments.back();
+    char* pos = seg.data() + seg.write_offset;
+    store<int32_t>(pos + 8, partition);
+    store<uint32_t>(pos + 12, topic.size());
+    store<uint32_t>(pos + 16, key_size);
+    store<uint32_t>(pos + 20, payload_size);
+    std::memcpy(pos + record_header_size, topic.data(), topic.size());
+    std::memcpy(pos + record_header_size + topic.size(), key, key_size);
+    std::memcpy(pos + record_header_size + topic.size() + key_size, payload, payload_size);
+    boost::crc_32_type checksum;
+    checksum.process_bytes(pos + 8, record_size - 8);
+    store<uint32_t>(pos + 4, checksum.checksum());
+    //the magic goes last, a record is only visible once it is complete
+    store<uint32_t>(pos, record_magic);
+    seg.write_offset += record_size;
+    ++records;
+    return true;
+}
+
+bool spill_journal::front (spill_record& record) {
+    std::lock_guard<std::mutex> lock(mtx);
+    while (!segments.empty()) {
+        segment& seg = *segments.front();
+        uint64_t next = 0;
+        if (seg.read_offset < seg.write_offset && read_record(seg, seg.read_offset, record, next)) {
+            return true;
+        }
+        if (segments.size() == 1) return false;
+        //fully read and no longer written, the segment can go
+        remove_front();
+    }
+    return false;
+}
+
+void spill_journal::pop () {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (segments.empty()) return;
+    segment& seg = *segments.front();
+    spill_record record;
+    uint64_t next = 0;
+    if (seg.read_offset < seg.write_offset && read_record(seg, seg.read_offset, record, next)) {
+        seg.read_offset = next;
+        store_read_offset(seg);
+        --records;
+    }
+    //free a drained segment right away, it still counts against max_size until removed
+    if (seg.read_offset >= seg.write_offset && segments.size() > 1) {
+        remove_front();
+    }
+}
+
+void spill_journal::sync () {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (auto& seg : segments) {
+        seg->region.flush();
+    }
+}
+
+bool spill_journal::empty () const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return records == 0;
+}
+
+uint64_t spill_journal::record_count () const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return records;
+}
+
+uint64_t spill_journal::size () const {
+    std::lock_guard<std::mutex> lock(mtx);
+    return total_size;
+}
+
+}
@@ -0,0 +1,160 @@
+//spill_journal only depends on boost, these cases run without nodeos or a kafka cluster
+#define BOOST_TEST_MODULE spill_journal
+#include <boost/test/included/unit_test.hpp>
+#include <eosio/kafka_plugin/spill_journal.hpp>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace eosio;
+namespace bfs = boost::filesystem;
+
+namespace {
+
+//a fresh directory removed again at the end of the case
+struct temp_dir {
+    temp_dir () : path(bfs::temp_directory_path() / bfs::unique_path("spill-journal-test-%%%%-%%%%")) {}
+    ~temp_dir () { bfs::remove_all(path); }
+    bfs::path path;
+};
+
+//record layout of spill_journal.cpp, the tests corrupt and truncate records at known offsets
+const uint64_t segment_header_size = 32;
+const uint64_t record_header_size = 24;
+
+bool append (spill_journal& journal, const std::string& topic, const std::string& key, const std::string& payload) {
+    return journal.append(topic, 1, key.data(), key.size(), payload.data(), payload.size());
+}
+
+std::string front_payload (spill_journal& journal) {
+    spill_record record;
+    BOOST_REQUIRE(journal.front(record));
+    return std::string(record.payload, record.payload_size);
+}
+
+std::vector<bfs::path> segment_files (const bfs::path& dir) {
+    std::vector<bfs::path> files;
+    for (bfs::directory_iterator itr(dir); itr != bfs::directory_iterator(); ++itr) {
+        if (itr->path().extension() == ".log") {
+            files.push_back(itr->path());
+        }
+    }
+    return files;
+}
+
+}
+
+BOOST_AUTO_TEST_CASE(append_pop_recover) {
+    temp_dir dir;
+    {
+        spill_journal journal(dir.path, 4096, 1024 * 1024);
+        BOOST_CHECK(journal.empty());
+        BOOST_CHECK(append(journal, "accepted-block", "k1", "first"));
+        BOOST_CHECK(append(journal, "applied-transaction", "k2", "second"));
+        BOOST_CHECK(append(journal, "accepted-block", "k3", "third"));
+        BOOST_CHECK_EQUAL(journal.record_count(), 3u);
+
+        spill_record record;
+        BOOST_REQUIRE(journal.front(record));
+        BOOST_CHECK_EQUAL(std::string(record.topic, record.topic_size), "accepted-block");
+        BOOST_CHECK_EQUAL(std::string(record.key, record.key_size), "k1");
+        BOOST_CHECK_EQUAL(record.partition, 1);
+        BOOST_CHECK_EQUAL(std::string(record.payload, record.payload_size), "first");
+        journal.pop();
+        BOOST_CHECK_EQUAL(journal.record_count(), 2u);
+    }
+    //the read offset survives the restart, the popped record does not come back
+    spill_journal journal(dir.path, 4096, 1024 * 1024);
+    BOOST_CHECK_EQUAL(journal.record_count(), 2u);
+    BOOST_CHECK_EQUAL(front_payload(journal), "second");
+    journal.pop();
+    BOOST_CHECK_EQUAL(front_payload(journal), "third");
+    journal.pop();
+    BOOST_CHECK(journal.empty());
+    spill_record record;
+    BOOST_CHECK(!journal.front(record));
+}
+
+BOOST_AUTO_TEST_CASE(corrupted_last_record_is_cut) {
+    temp_dir dir;
+    uint64_t second_payload = 0;
+    {
+        spill_journal journal(dir.path, 4096, 1024 * 1024);
+        BOOST_CHECK(append(journal, "t", "k", "first"));
+        BOOST_CHECK(append(journal, "t", "k", "second"));
+        second_payload = segment_header_size + 2 * (record_header_size + 2) + 5;
+    }
+    auto files = segment_files(dir.path);
+    BOOST_REQUIRE_EQUAL(files.size(), 1u);
+    {
+        std::fstream file(files.front().string(), std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(second_payload);
+        file.put('X');
+    }
+    spill_journal journal(dir.path, 4096, 1024 * 1024);
+    BOOST_CHECK_EQUAL(journal.record_count(), 1u);
+    //a new record goes where the corrupted one was, behind the good one
+    BOOST_CHECK(append(journal, "t", "k", "third"));
+    BOOST_CHECK_EQUAL(front_payload(journal), "first");
+    journal.pop();
+    BOOST_CHECK_EQUAL(front_payload(journal), "third");
+    journal.pop();
+    BOOST_CHECK(journal.empty());
+}
+
+BOOST_AUTO_TEST_CASE(truncated_last_record_is_cut) {
+    temp_dir dir;
+    {
+        spill_journal journal(dir.path, 4096, 1024 * 1024);
+        BOOST_CHECK(append(journal, "t", "k", "first"));
+        BOOST_CHECK(append(journal, "t", "k", "second"));
+    }
+    auto files = segment_files(dir.path);
+    BOOST_REQUIRE_EQUAL(files.size(), 1u);
+    //the file ends in the middle of the second record, as after a crash while extending it
+    bfs::resize_file(files.front(), segment_header_size + (record_header_size + 2 + 5) + record_header_size + 3);
+    spill_journal journal(dir.path, 4096, 1024 * 1024);
+    BOOST_CHECK_EQUAL(journal.record_count(), 1u);
+    BOOST_CHECK_EQUAL(front_payload(journal), "first");
+}
+
+BOOST_AUTO_TEST_CASE(full_journal_rejects_append) {
+    temp_dir dir;
+    //two segments of 4096 bytes, each one holds four records of 1000 bytes
+    spill_journal journal(dir.path, 4096, 8192);
+    std::string payload(1000 - record_header_size - 2, 'p');
+    uint64_t appended = 0;
+    while (append(journal, "t", "k", payload)) {
+        ++appended;
+        BOOST_REQUIRE(appended <= 8);
+    }
+    BOOST_CHECK_EQUAL(appended, 8u);
+    BOOST_CHECK_EQUAL(journal.record_count(), 8u);
+    BOOST_CHECK_EQUAL(journal.size(), 8192u);
+    //draining the first segment frees its room again
+    for (int i = 0; i < 4; i++) {
+        journal.pop();
+    }
+    BOOST_CHECK(append(journal, "t", "k", payload));
+}
+
+BOOST_AUTO_TEST_CASE(drained_segments_are_deleted) {
+    temp_dir dir;
+    spill_journal journal(dir.path, 4096, 1024 * 1024);
+    std::string payload(1000 - record_header_size - 2, 'p');
+    for (int i = 0; i < 9; i++) {
+        BOOST_CHECK(append(journal, "t", "k", payload));
+    }
+    BOOST_CHECK_EQUAL(segment_files(dir.path).size(), 3u);
+    for (int i = 0; i < 4; i++) {
+        journal.pop();
+    }
+    BOOST_CHECK_EQUAL(segment_files(dir.path).size(), 2u);
+    for (int i = 0; i < 5; i++) {
+        journal.pop();
+    }
+    //the last segment stays for the next append
+    BOOST_CHECK(journal.empty());
+    BOOST_CHECK_EQUAL(segment_files(dir.path).size(), 1u);
+    BOOST_CHECK_EQUAL(journal.size(), 4096u);
+}